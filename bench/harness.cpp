@@ -0,0 +1,304 @@
+#include "../src/program.hpp"
+#include "../src/context.hpp"
+#include "../src/interpreter.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Runs each benchmark script a number of times and reports the median and 99th percentile
+// time, statements per second and peak RSS. Every benchmark runs in its own process, so that
+// the peak RSS of one does not hide that of the next.
+//
+// The harness is built with LITHIUM_METRICS, which is where the statement counts come from.
+// Results can be written to a baseline file, and later compared against one. Each line of a
+// baseline is tab separated: name, median ns, p99 ns, statements per second, peak RSS in KB.
+
+namespace{
+
+struct Benchmark{
+    std::string name;
+    std::string source;
+};
+
+struct Result{
+    std::string name;
+    uint64_t median_ns, p99_ns, statements_per_second, peak_rss_kb;
+};
+
+// What a benchmark process sends back to the harness.
+struct Report{
+    bool ok;
+    uint64_t statements;
+};
+
+uint64_t now(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool readFile(const std::string &path, std::string &out){
+    FILE *const file = fopen(path.c_str(), "rb");
+    if(!file)
+        return false;
+    char buffer[4096];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), file)))
+        out.append(buffer, n);
+    fclose(file);
+    return true;
+}
+
+// A long script with many small functions, which stresses compiling the program as much as
+// running it.
+std::string generateScript(uint64_t functions){
+    std::string src;
+    for(uint64_t i = 0; i<functions; i++){
+        const std::string n = std::to_string(i);
+        src += "function int f" + n + "(int n):\n";
+        src += "    int a get n * " + n + " + 1\n";
+        src += "    if get a:\n        set a get a - 1\n    .\n";
+        src += "    string s \"function " + n + "\"\n";
+        src += "    return get a + 3\n.\n";
+    }
+    src += "int sum 0\n";
+    for(uint64_t i = 0; i<functions; i++)
+        src += "set sum get sum + call get f" + std::to_string(i) + "(" + std::to_string(i) + ")\n";
+    return src;
+}
+
+std::string baseName(const std::string &path){
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    const std::string::size_type dot = name.rfind('.');
+    if(dot!=std::string::npos && dot)
+        name.resize(dot);
+    return name;
+}
+
+bool writeAll(int fd, const void *data, size_t size){
+    const char *at = static_cast<const char*>(data);
+    while(size){
+        const ssize_t n = write(fd, at, size);
+        if(n<=0)
+            return false;
+        at += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool readAll(int fd, void *data, size_t size){
+    char *at = static_cast<char*>(data);
+    while(size){
+        const ssize_t n = read(fd, at, size);
+        if(n<=0)
+            return false;
+        at += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Body of the benchmark process. Compiling the program is part of every timed run.
+void runChild(const Benchmark &bench, uint64_t runs, int fd){
+    Report report = {true, 0llu};
+    std::vector<uint64_t> times;
+
+    for(uint64_t i = 0; i<runs && report.ok; i++){
+        const uint64_t start = now();
+
+        const Lithium::Program program(bench.source);
+        if(!program.valid()){
+            fprintf(stderr, "%s: error on line %llu: %s\n", bench.name.c_str(),
+                (unsigned long long)program.error().line + 1, program.error().what.c_str());
+            report.ok = false;
+            break;
+        }
+
+        Lithium::Context ctx(program);
+        if(!Lithium::InterpretProgram(ctx)){
+            fprintf(stderr, "%s: error on line %llu: %s\n", bench.name.c_str(),
+                (unsigned long long)ctx.error.line + 1, ctx.error.what.c_str());
+            report.ok = false;
+            break;
+        }
+
+        times.push_back(now() - start);
+        report.statements = ctx.metrics.statements;
+    }
+
+    writeAll(fd, &report, sizeof(report));
+    if(report.ok)
+        writeAll(fd, times.data(), times.size() * sizeof(uint64_t));
+}
+
+bool runBenchmark(const Benchmark &bench, uint64_t runs, Result &result){
+    int fds[2];
+    if(pipe(fds)!=0){
+        perror("pipe");
+        return false;
+    }
+
+    fflush(stdout);
+    const pid_t child = fork();
+    if(child<0){
+        perror("fork");
+        return false;
+    }
+    if(child==0){
+        close(fds[0]);
+        runChild(bench, runs, fds[1]);
+        close(fds[1]);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    Report report = {false, 0llu};
+    std::vector<uint64_t> times(runs);
+    bool ok = readAll(fds[0], &report, sizeof(report)) && report.ok &&
+        readAll(fds[0], times.data(), runs * sizeof(uint64_t));
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if(wait4(child, &status, 0, &usage)!=child || !WIFEXITED(status) || WEXITSTATUS(status)!=EXIT_SUCCESS)
+        ok = false;
+    if(!ok)
+        return false;
+
+    std::sort(times.begin(), times.end());
+    result.name = bench.name;
+    result.median_ns = times[runs/2];
+    result.p99_ns = times[std::min<uint64_t>(runs - 1, (runs * 99 + 99) / 100 - 1)];
+    result.statements_per_second = result.median_ns ? report.statements * 1000000000llu / result.median_ns : 0llu;
+    result.peak_rss_kb = usage.ru_maxrss;
+    return true;
+}
+
+bool readBaseline(const std::string &path, std::map<std::string, Result> &baseline){
+    FILE *const file = fopen(path.c_str(), "r");
+    if(!file)
+        return false;
+
+    char name[256];
+    unsigned long long median, p99, sps, rss;
+    while(fscanf(file, "%255s %llu %llu %llu %llu", name, &median, &p99, &sps, &rss)==5)
+        baseline[name] = {name, median, p99, sps, rss};
+
+    fclose(file);
+    return true;
+}
+
+bool writeBaseline(const std::string &path, const std::vector<Result> &results){
+    FILE *const file = fopen(path.c_str(), "w");
+    if(!file)
+        return false;
+    for(const Result &r : results){
+        fprintf(file, "%s\t%llu\t%llu\t%llu\t%llu\n", r.name.c_str(), (unsigned long long)r.median_ns,
+            (unsigned long long)r.p99_ns, (unsigned long long)r.statements_per_second, (unsigned long long)r.peak_rss_kb);
+    }
+    fclose(file);
+    return true;
+}
+
+void usage(){
+    fputs("Usage: harness [options] [script.lcl ...]\n"
+        "  --runs=<n>             Runs of each benchmark, default 11\n"
+        "  --generated=<n>        Functions in the generated script, default 2000, 0 to skip it\n"
+        "  --baseline=<file>      Compare against a baseline file\n"
+        "  --threshold=<percent>  Slowdown of the median that counts as a regression, default 10\n"
+        "  --write-baseline=<file>\n"
+        "                         Write the results as a baseline file\n", stderr);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]){
+    uint64_t runs = 11llu, generated = 2000llu;
+    double threshold = 10.0;
+    std::string baseline_path, output_path;
+    std::vector<std::string> paths;
+
+    for(int i = 1; i<argc; i++){
+        if(!strncmp(argv[i], "--runs=", 7))
+            runs = strtoull(argv[i] + 7, nullptr, 10);
+        else if(!strncmp(argv[i], "--generated=", 12))
+            generated = strtoull(argv[i] + 12, nullptr, 10);
+        else if(!strncmp(argv[i], "--baseline=", 11))
+            baseline_path = argv[i] + 11;
+        else if(!strncmp(argv[i], "--threshold=", 12))
+            threshold = strtod(argv[i] + 12, nullptr);
+        else if(!strncmp(argv[i], "--write-baseline=", 17))
+            output_path = argv[i] + 17;
+        else if(argv[i][0]=='-' && argv[i][1]=='-'){
+            usage();
+            return EXIT_FAILURE;
+        }
+        else
+            paths.push_back(argv[i]);
+    }
+
+    if(runs==0llu){
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Benchmark> benchmarks;
+    for(const std::string &path : paths){
+        Benchmark bench = {baseName(path), std::string()};
+        if(!readFile(path, bench.source)){
+            fprintf(stderr, "Could not open %s\n", path.c_str());
+            return EXIT_FAILURE;
+        }
+        benchmarks.push_back(std::move(bench));
+    }
+    if(generated)
+        benchmarks.push_back({"generated", generateScript(generated)});
+
+    std::map<std::string, Result> baseline;
+    if(!baseline_path.empty() && !readBaseline(baseline_path, baseline)){
+        fprintf(stderr, "Could not open %s\n", baseline_path.c_str());
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results;
+    bool ok = true;
+
+    printf("%-16s %12s %12s %14s %12s %10s\n", "benchmark", "median ms", "p99 ms", "statements/s", "peak RSS KB", "change");
+    for(const Benchmark &bench : benchmarks){
+        Result r;
+        if(!runBenchmark(bench, runs, r)){
+            fprintf(stderr, "%s failed\n", bench.name.c_str());
+            ok = false;
+            continue;
+        }
+        results.push_back(r);
+
+        printf("%-16s %12.3f %12.3f %14llu %12llu", r.name.c_str(), r.median_ns / 1.0e6, r.p99_ns / 1.0e6,
+            (unsigned long long)r.statements_per_second, (unsigned long long)r.peak_rss_kb);
+
+        const std::map<std::string, Result>::const_iterator base = baseline.find(r.name);
+        if(base!=baseline.cend() && base->second.median_ns){
+            const double change = ((double)r.median_ns / base->second.median_ns - 1.0) * 100.0;
+            const bool regressed = change > threshold;
+            printf(" %+9.1f%%%s\n", change, regressed ? "  REGRESSION" : "");
+            if(regressed)
+                ok = false;
+        }
+        else
+            printf(" %10s\n", "-");
+    }
+
+    if(!output_path.empty() && !writeBaseline(output_path, results)){
+        fprintf(stderr, "Could not write %s\n", output_path.c_str());
+        return EXIT_FAILURE;
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,280 @@
+#include "../src/program.hpp"
+#include "../src/context.hpp"
+#include "../src/numberparse.hpp"
+#include "../src/variables.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace Lithium;
+
+// Component benchmarks of the interpreter's hot primitives. Each one runs over synthetic input
+// of increasing size, and reports the time per operation, so that the rows of a benchmark
+// show how it scales.
+//
+// Every benchmark repeats its body until it has run for at least the minimum time, and then
+// reports the fastest of a few such batches.
+
+namespace{
+
+const uint64_t min_batch_ns = 20000000llu, batches = 3llu;
+
+std::string filter;
+
+// Keeps results alive so that the work that made them is not optimized away.
+volatile uint64_t sink;
+
+uint64_t now(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Body runs the benchmark once and returns the number of operations it did.
+template<typename Body>
+void measure(const char *name, uint64_t size, const char *unit, Body body){
+    if(!filter.empty() && !strstr(name, filter.c_str()))
+        return;
+
+    double best = 0.0;
+    for(uint64_t b = 0; b<batches; b++){
+        uint64_t ops = 0llu;
+        const uint64_t start = now();
+        uint64_t elapsed;
+        do{
+            ops += body();
+        }while((elapsed = now() - start) < min_batch_ns);
+
+        const double per_op = (double)elapsed / ops;
+        if(b==0 || per_op < best)
+            best = per_op;
+    }
+
+    printf("%-24s %10llu %-12s %12.2f ns/op %12.2f Mop/s\n", name, (unsigned long long)size, unit, best, 1.0e3 / best);
+}
+
+std::string identifiers(uint64_t count){
+    std::string src;
+    for(uint64_t i = 0; i<count; i++)
+        src += "name_" + std::to_string(i * 7919llu) + (i%3 ? " " : " \t ");
+    return src;
+}
+
+std::string stringLiterals(uint64_t count, uint64_t length){
+    std::string src;
+    for(uint64_t i = 0; i<count; i++){
+        src += '"';
+        src.append(length, 'x');
+        if(i%4==0)
+            src += "\\\"";
+        src += "\" ";
+    }
+    return src;
+}
+
+std::string numbers(uint64_t count){
+    std::string src;
+    for(uint64_t i = 0; i<count; i++){
+        switch(i%4){
+            case 0: src += std::to_string(i * 104729llu); break;
+            case 1: src += std::to_string(i) + "." + std::to_string(i * 31llu); break;
+            case 2: src += "0x" + std::to_string(i * 13llu); break;
+            case 3: src += "0" + std::to_string(i%8); break;
+        }
+        src += ' ';
+    }
+    return src;
+}
+
+void benchSource(){
+    for(uint64_t count = 1llu<<6; count<=1llu<<16; count <<= 2){
+        const std::string src = identifiers(count);
+
+        measure("skipWhitespace", src.length(), "bytes", [&src](){
+            Source s(src);
+            uint64_t n = 0llu;
+            while(s.skipWhitespace()){
+                while(s.valid() && s.peekc()!=' ' && s.peekc()!='\t')
+                    s.getc();
+                n++;
+            }
+            sink = n;
+            return (uint64_t)src.length();
+        });
+
+        measure("getIdentifier", count, "identifiers", [&src, count](){
+            Source s(src);
+            std::string ident;
+            uint64_t n = 0llu;
+            while(s.getIdentifier(ident)){
+                n += ident.length();
+                ident.clear();
+            }
+            sink = n;
+            return count;
+        });
+    }
+
+    for(uint64_t length = 4llu; length<=1024llu; length <<= 2){
+        const uint64_t count = 4096llu;
+        const std::string src = stringLiterals(count, length);
+        measure("getStringLiteral", length, "chars", [&src, count](){
+            Source s(src);
+            std::string str;
+            uint64_t n = 0llu;
+            while(s.skipWhitespace() && s.getStringLiteral(str)){
+                n += str.length();
+                str.clear();
+            }
+            sink = n;
+            return count;
+        });
+    }
+}
+
+void benchNumbers(){
+    for(uint64_t count = 1llu<<6; count<=1llu<<16; count <<= 2){
+        const Program program(numbers(count));
+        Context ctx(program);
+        measure("ParseNumberLiteral", count, "numbers", [&ctx, &program, count](){
+            ctx.source().position(program.source().cbegin());
+            Value val;
+            uint64_t n = 0llu;
+            while(ctx.source().skipWhitespace() && ParseNumberLiteral(ctx, val))
+                n += val.value.integer;
+            sink = n;
+            return count;
+        });
+    }
+}
+
+// The interpreter's skip_scope is a lookup in the program's scope table, so this measures how
+// that lookup scales with the number of scopes in the program. The program is not optimized,
+// since that would remove its constant if statements.
+void benchScopes(){
+    CompileOptions options;
+    options.optimize = false;
+    for(uint64_t count = 1llu<<4; count<=1llu<<16; count <<= 2){
+        std::string src;
+        std::vector<uint64_t> opens;
+        for(uint64_t i = 0; i<count; i++){
+            src += "if 1:\n";
+            opens.push_back(src.length() - 2);
+            src += "    int x 1\n.\n";
+        }
+        const Program program(src, options);
+        if(!program.valid()){
+            fprintf(stderr, "skip_scope: %s\n", program.error().what.c_str());
+            return;
+        }
+
+        measure("skip_scope", count, "scopes", [&program, &opens](){
+            Source s(program.source());
+            uint64_t n = 0llu;
+            for(uint64_t open : opens){
+                std::string::const_iterator close;
+                if(!program.scopeEnd(program.source().cbegin() + open, close)){
+                    fprintf(stderr, "skip_scope: no scope opens at offset %llu\n", (unsigned long long)open);
+                    exit(EXIT_FAILURE);
+                }
+                s.position(close);
+                n += s.peekc();
+            }
+            sink = n;
+            return opens.size();
+        });
+    }
+}
+
+// Looks up a global from underneath depth function frames of four slots each.
+void benchLookup(){
+    const Program program("int global 1\n");
+    static const char *const names[] = {"a", "b", "c", "d"};
+
+    for(uint64_t depth = 1llu; depth<=256llu; depth <<= 2){
+        Context ctx(program);
+        Value val = {Value::Integer, {}};
+        ctx.addVariable("global", val);
+        for(uint64_t i = 0; i<depth; i++){
+            ctx.pushFrame(program.source().cbegin(), program.source().cend(), 4llu);
+            for(const char *name : names)
+                ctx.addSlot(name, val);
+        }
+
+        const std::string global("global"), local("a");
+        measure("findObject global", depth, "frames", [&ctx, &global](){
+            uint64_t n = 0llu;
+            for(uint64_t i = 0; i<1024llu; i++)
+                n += ctx.findObject(global).type;
+            sink = n;
+            return 1024llu;
+        });
+        measure("findObject local", depth, "frames", [&ctx, &local](){
+            uint64_t n = 0llu;
+            for(uint64_t i = 0; i<1024llu; i++)
+                n += ctx.findObject(local).type;
+            sink = n;
+            return 1024llu;
+        });
+    }
+}
+
+void benchCasts(){
+    for(uint64_t count = 1llu<<6; count<=1llu<<16; count <<= 2){
+        std::vector<Value> values(count);
+        for(uint64_t i = 0; i<count; i++){
+            if(i%2){
+                values[i].type = Value::Floating;
+                values[i].value.floating = i * 0.5f;
+            }
+            else{
+                values[i].type = Value::Integer;
+                values[i].value.integer = i;
+            }
+        }
+
+        measure("CastValue", count, "values", [&values](){
+            uint64_t n = 0llu;
+            Value to;
+            for(const Value &v : values){
+                CastValue(v, Value::Floating, to);
+                CastValue(v, Value::Integer, to);
+                n += to.value.integer;
+            }
+            sink = n;
+            return values.size() * 2;
+        });
+
+        measure("MutualCastValue", count, "pairs", [&values](){
+            uint64_t n = 0llu;
+            for(uint64_t i = 1; i<values.size(); i++){
+                Value a = values[i-1], b = values[i];
+                MutualCastValue(a, b);
+                n += a.type;
+            }
+            sink = n;
+            return values.size() - 1;
+        });
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]){
+    for(int i = 1; i<argc; i++){
+        if(!strncmp(argv[i], "--filter=", 9))
+            filter = argv[i] + 9;
+        else{
+            fputs("Usage: micro [--filter=<name>]\n", stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    benchSource();
+    benchNumbers();
+    benchScopes();
+    benchLookup();
+    benchCasts();
+    return EXIT_SUCCESS;
+}
@@ -1,4 +1,5 @@
 #include "context.hpp"
+#include "dict.hpp"
 #include <cassert>
 
 namespace Lithium{
@@ -11,30 +12,24 @@ char Source::getc(){
     if(at==end)
         return 0;
 
-    const char c = *at;
-    at++;
-
-    if(c=='\n')
-        line_++;
-
-    return c;
+    return *(at++);
 }
 
 char Source::peekc() const{
     return (at==end)?'\0':(*at);
 }
 
+char Source::peekc(uint64_t ahead) const{
+    return (uint64_t)(end - at) > ahead ? at[ahead] : '\0';
+}
+
 // Equivalent to `return getc()==c`
 bool Source::match(char c){
     return getc()==c;
 }
 
-uint64_t Source::line() const{
-    return line_;
-}
-
 Source::Source(const std::string &s)
-  : start(s.cbegin()), end(s.cend()), at(s.cbegin()), src(&s), line_(0llu){
+  : start(s.cbegin()), end(s.cend()), at(s.cbegin()), src(&s){
 
 }
 
@@ -64,9 +59,7 @@ bool Source::skipWhitespace(){
 bool Source::skipWhitespaceAndNewline(){
     while(at!=end){
         switch(*at){
-            case '\n':
-                line_++;
-            case ' ': case '\t': case '\r': case '\v':
+            case '\n': case ' ': case '\t': case '\r': case '\v':
                 at++;
                 continue;
             case '%':
@@ -80,9 +73,35 @@ bool Source::skipWhitespaceAndNewline(){
     return at!=end;
 }
 
-Context::Context(const std::string &str)
-  : src_str_(str), src_(src_str_){
+Context::Context(const Program &program)
+  : program_(program), src_(program.source()), heap_(&metrics), global_scope_(0llu), watermark_(nullptr), slots_top_(0llu),
+  fuel_(INT64_MAX), fuel_handler_(nullptr), fuel_user_(nullptr), unwinding(false), profiler(nullptr), output(nullptr),
+  error({Error::NoError, 0llu, std::string()}){
+    Value global;
+    global.type = Value::Object;
+    global.value.object = heap_.create<std::map<std::string, Value> >(Value::Object);
+    scopes.push_back({src_.position(), program.source().cend(), global, 0llu, 0llu});
 
+    watermark_ = heap_.mark();
+}
+
+bool Context::refuel(){
+    fuel_ = 0;
+    if(fuel_handler_ && !fuel_handler_(*this, fuel_user_)){
+        if(error.type==Error::NoError)
+            setError(Error::ResourceError, "Stopped by the fuel handler");
+        return false;
+    }
+    if(fuel_<=0)
+        return setError(Error::ResourceError, "Out of fuel");
+    // The unit that ran out is paid for from the new fuel.
+    fuel_--;
+    return true;
+}
+
+bool Context::outOfMemory(Value::Type type){
+    return setError(Error::ResourceError, std::string("Out of memory: ") + ValueName(type) +
+        " would pass the limit of " + std::to_string(heap_.hardLimit()) + " bytes");
 }
 
 Source &Context::source(){
@@ -90,38 +109,198 @@ Source &Context::source(){
 }
 
 void Context::push(Value &var){
-    stack.push(var);
+    stack.push_back(var);
+    LITHIUM_METRIC(if(stack.size() > metrics.stack_high_water) metrics.stack_high_water = stack.size());
 }
 
 Value Context::pop(){
-    Value val = stack.top();
-    stack.pop();
-    return std::move(val);
+    Value val = stack.back();
+    stack.pop_back();
+    return val;
 }
 
 Value &Context::top(){
-    return stack.top();
+    return stack.back();
 }
 
-// Adds to the outer scope
-Value &Context::addVariable(const std::string &name, Value &var){
-    assert(scopes.back().scope.type==Value::Object);
+void Context::assign(Value &variable, const Value &var){
+    // Retained first, in case the variable already holds var.
+    retain(var);
+    release(variable);
+    variable = var;
+}
 
-    scopes.back().scope.value.object->insert({name, var});
+void Context::release(const Value &var){
+    const void *const payload = Heap::container(var);
+    if(!payload || !Heap::release(payload))
+        return;
+    for(const Value &pending : stack){
+        if(Heap::container(pending)==payload)
+            return;
+    }
+
+    // Anything that refers to the payload now only ever sees it empty.
+    if(var.type==Value::Array)
+        std::vector<Value>().swap(*var.value.array);
+    else if(var.type==Value::Object)
+        var.value.object->clear();
+    else
+        *var.value.dict = Dict(var.value.dict->element());
+    heap_.update(payload);
+}
+
+bool Context::owned(const void *payload) const {
+    if(!Heap::owned(payload))
+        return false;
+    for(const Value &pending : stack){
+        if(Heap::container(pending)==payload)
+            return false;
+    }
+    return true;
+}
+
+// Adds to the innermost scope
+Value &Context::addVariable(const std::string &name, Value &var){
+    declareVariable(name, var);
     return var;
 }
 
-Value Context::findObject(const std::string &name, std::vector<Scope>::iterator i, std::vector<Scope>::iterator end){
-    if(i==end)
-        return {Value::Null, {}};
+VariableSlot Context::declareVariable(const std::string &name, const Value &var){
+    Scope &scope = scopes.back();
+    if(scope.scope.type==Value::Object){
+        Value &global = (*scope.scope.value.object)[name];
+        assign(global, var);
+        return {&global, 0llu};
+    }
 
-    assert(i->scope.type==Value::Object);
+    // Redeclarations, as in the body of a loop, reuse the same slot.
+    for(uint64_t i = scope.first_slot; i<slots_top_; i++){
+        if(slots_[i].name==name){
+            assign(slots_[i].value, var);
+            return {nullptr, i};
+        }
+    }
+    addSlot(name, var);
+    return {nullptr, slots_top_ - 1llu};
+}
+
+void Context::pushFrame(std::string::const_iterator start, std::string::const_iterator end, uint64_t size){
+    if(slots_.size() < slots_top_ + size)
+        slots_.resize(slots_top_ + size);
+    Value frame = {Value::Null, {}};
+    scopes.push_back({start, end, frame, slots_top_, 0llu});
+}
 
-    auto x = i->scope.value.object->find(name);
-    if(x==i->scope.value.object->cend())
-        return findObject(name, i++, end);
+void Context::addSlot(const std::string &name, const Value &var){
+    assert(scopes.back().scope.type==Value::Null);
+    assert(scopes.back().first_slot + scopes.back().num_slots == slots_top_);
+
+    if(slots_top_==slots_.size())
+        slots_.resize(slots_.size() * 2 + 8);
+
+    Slot &slot = slots_[slots_top_++];
+    slot.name = name;
+    slot.value = var;
+    retain(var);
+    scopes.back().num_slots++;
+}
+
+void Context::popFrame(){
+    assert(scopes.back().scope.type==Value::Null);
+    for(uint64_t i = scopes.back().first_slot; i<slots_top_; i++)
+        release(slots_[i].value);
+    slots_top_ = scopes.back().first_slot;
+    scopes.pop_back();
+}
+
+void Context::addGlobal(const std::string &name, const Value &var){
+    assign((*scopes[global_scope_].scope.value.object)[name], var);
+}
+
+bool Context::setVariable(const std::string &name, const Value &var){
+    uint64_t scope;
+    Value *const val = lookup(name, scope);
+    if(!val)
+        return false;
+
+    if(scope<global_scope_)
+        addGlobal(name, var);
     else
-        return x->second;
+        assign(*val, var);
+    return true;
+}
+
+void Context::setWatermark(){
+    // The overlay is needed whatever the limits are, and is only ever a few bytes over them.
+    const uint64_t soft_limit = heap_.softLimit(), hard_limit = heap_.hardLimit();
+    heap_.setLimits(0llu, 0llu);
+    Value overlay;
+    overlay.type = Value::Object;
+    overlay.value.object = heap_.create<std::map<std::string, Value> >(Value::Object);
+    heap_.setLimits(soft_limit, hard_limit);
+
+    global_scope_ = scopes.size();
+    scopes.push_back({src_.position(), program_.source().cend(), overlay, 0llu, 0llu});
+
+    heap_.freeze();
+    watermark_ = heap_.mark();
+}
+
+void Context::viewGlobals(const Context &that){
+    assert(scopes.size()==1 && global_scope_==0llu);
+    const Scope own = scopes.back();
+    scopes.clear();
+    for(const Scope &scope : that.scopes){
+        if(scope.scope.type!=Value::Object)
+            break;
+        scopes.push_back(scope);
+    }
+    global_scope_ = scopes.size();
+    scopes.push_back(own);
+}
+
+void Context::reset(){
+    heap_.rollback(watermark_);
+
+    stack.clear();
+    scopes.resize(global_scope_ + 1);
+    scopes.back().scope.value.object->clear();
+    slots_top_ = 0llu;
+
+    src_.position(program_.source().cbegin());
+    unwinding = false;
+    error = {Error::NoError, 0llu, std::string()};
+}
+
+Value *Context::lookup(const std::string &name, uint64_t &scope){
+    LITHIUM_METRIC(metrics.lookups++);
+    for(scope = scopes.size(); scope--; ){
+        LITHIUM_METRIC(metrics.scopes_walked++);
+        const Scope &i = scopes[scope];
+        if(i.scope.type==Value::Object){
+            const std::map<std::string, Value>::iterator x = i.scope.value.object->find(name);
+            if(x!=i.scope.value.object->end())
+                return &x->second;
+        }
+        else{
+            for(uint64_t s = i.first_slot + i.num_slots; s-- > i.first_slot; ){
+                if(slots_[s].name==name)
+                    return &slots_[s].value;
+            }
+        }
+    }
+    return nullptr;
+}
+
+Value Context::findObject(const std::string &name){
+    uint64_t scope;
+    if(const Value *const val = lookup(name, scope))
+        return *val;
+
+    Value func = {Value::Null, {}};
+    if((func.value.function = program_.findFunction(name)))
+        func.type = Value::Function;
+    return func;
 }
 
 } // namespace Lithium
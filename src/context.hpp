@@ -1,15 +1,19 @@
 #pragma once
 #include <string>
 #include <vector>
-#include <stack>
 #include "variables.hpp"
+#include "program.hpp"
+#include "heap.hpp"
+#include "metrics.hpp"
 
 namespace Lithium{
 
+class Profiler;
+class Output;
+
 class Source{
     std::string::const_iterator start, end, at;
     const std::string *src;
-    uint64_t line_;
 
     bool skipComment();
 
@@ -21,15 +25,17 @@ public:
     bool valid() const;
 
     inline std::string::const_iterator position() const { return at; }
-    inline void position(std::string::const_iterator &i){ at = i; }
+    inline void position(std::string::const_iterator i){ at = i; }
 
     char getc();
     char peekc() const;
+    char peekc(uint64_t ahead) const;
 
     // Equivalent to `return getc()==c`
     bool match(char c);
 
-    uint64_t line() const;
+    // Lines are not tracked as the source is read. Program::line finds the line of an offset.
+    inline uint64_t offset() const { return at - start; }
 
     bool skipWhitespace();
     bool skipWhitespaceAndNewline();
@@ -51,6 +57,7 @@ public:
     static inline bool isAlphaNum(char c){ return isNum(c) || isAlpha(c); }
     static inline bool isIdent(char c){ return isAlphaNum(c) || c=='_'; }
     static inline bool isQuote(char c){ return c=='"'; }
+    static inline bool isNotQuote(char c){ return c!='"'; }
 
     static inline bool always_(char c){ if(c){} return true; }
     static inline bool never_(char c){ if(c){} return false; }
@@ -71,53 +78,165 @@ public:
 
     inline bool getIdentifier(std::string &str){ return skipWhitespace() && getString<isAlpha, isIdent>(str); }
     inline bool getAlphaIdentifier(std::string &str){ return skipWhitespace() && getString<isAlpha, isAlpha>(str); }
+    // The only escape is \", so the literal is appended a run at a time between escapes.
     inline bool getStringLiteral(std::string &str){
         if(!(str.empty() && skipWhitespace() && match('"')))
             return false;
-    grab_string:
-        {
-            std::string x;
-            if(!(getString<always_, isQuote>(x) && match('"')))
+        while(true){
+            const std::string::const_iterator run = at;
+            while(at!=end && *at!='"')
+                at++;
+            if(at==end)
                 return false;
-            str.append(std::move(x));
-            if(!str.empty() && str.back()=='\\'){
-                str.pop_back();
-                goto grab_string;
-            }
+
+            const bool escaped = at!=run && at[-1]=='\\';
+            str.append(run, escaped ? at - 1 : at);
+            at++;
+            if(!escaped)
+                return true;
+            str += '"';
         }
-        return true;
     }
 };
 
+// A variable in a function's frame.
+struct Slot{
+    std::string name;
+    Value value;
+};
+
+// Where a variable is stored. Unlike a pointer to a frame slot, this stays valid as the frame
+// stack grows.
+struct VariableSlot{
+    // Set for variables in a global scope, whose members never move.
+    Value *global;
+    uint64_t slot;
+};
+
 struct Scope{
     std::string::const_iterator start, end;
+    // Global scopes keep their variables in an Object. Function scopes leave this Null, and keep
+    // their variables in slots [first_slot, first_slot+num_slots) of the Context's frame stack.
     Value scope;
+    uint64_t first_slot, num_slots;
 };
 
+// The state of one execution of a Program. A Context is cheap to create, and any number of
+// Contexts can share one Program. The Program must outlive every Context made from it.
 class Context{
-    std::string src_str_;
+    const Program &program_;
     Source src_;
-    std::stack<Value, std::vector<Value> > stack;
+public:
+    // Always-on counters, which are only updated when built with LITHIUM_METRICS.
+    Metrics metrics;
+private:
+    Heap heap_;
+    std::vector<Value> stack;
+
+    // Scopes below this are frozen by the watermark. Assignments to their variables are
+    // shadowed in this scope instead, so that reset() never has to undo them.
+    uint64_t global_scope_;
+    Heap::Mark watermark_;
+
+    // The frame stack. Slots above the top are kept, names and all, to be reused by the next call.
+    std::vector<Slot> slots_;
+    uint64_t slots_top_;
+
+    Value *lookup(const std::string &name, uint64_t &scope);
+
+public:
+    typedef bool (*FuelHandler)(Context &ctx, void *user);
+private:
+    int64_t fuel_;
+    FuelHandler fuel_handler_;
+    void *fuel_user_;
+
+    bool refuel();
+
 public:
 
     // Includes the global scope on the bottom.
     std::vector<Scope> scopes;
 
-    Context(const std::string &source);
+    // Set by return and up, and cleared by the call that they return from.
+    bool unwinding;
+
+    // Optional, and not owned.
+    Profiler *profiler;
+    // Where the print builtins write. Optional, and not owned.
+    Output *output;
+
+    Context(const Program &program);
+
+    inline const Program &program() const { return program_; }
+    inline Heap &heap() { return heap_; }
+
+    // Like heap().create and heap().update, but past the heap's hard limit the error is set to
+    // a ResourceError.
+    template<typename T, typename... Args>
+    inline T *create(Value::Type type, Args&&... args){
+        T *const payload = heap_.create<T>(type, std::forward<Args>(args)...);
+        if(!payload)
+            outOfMemory(type);
+        return payload;
+    }
+    inline bool update(const void *payload, Value::Type type){ return heap_.update(payload) || outOfMemory(type); }
+    bool outOfMemory(Value::Type type);
 
     Source &source();
     void push(Value &var);
     Value pop();
     Value &top();
+    inline uint64_t stackSize() const { return stack.size(); }
+    // Only valid until the next push.
+    inline const Value *stackAt(uint64_t i) const { return stack.data() + i; }
+    inline void drop(uint64_t n){ stack.resize(stack.size() - n); }
 
-    // Adds to the outer scope
+    // Variables count the arrays, objects and dicts that they hold. assign() replaces what a
+    // variable holds. release() drops a variable's hold, and once nothing refers to the payload,
+    // frees what it holds, leaving it empty until its block is rolled back.
+    void assign(Value &variable, const Value &var);
+    inline void retain(const Value &var){
+        if(const void *const payload = Heap::container(var))
+            Heap::retain(payload);
+    }
+    void release(const Value &var);
+    // Whether payload can be written in place: at most one variable holds it, it is not shared,
+    // and it is not waiting on the operand stack.
+    bool owned(const void *payload) const;
+
+    // Adds to the innermost scope
     Value &addVariable(const std::string &name, Value &var);
+    // Like addVariable, but returns where the variable is, so that a loop can assign to it on
+    // every iteration without looking it up by name.
+    VariableSlot declareVariable(const std::string &name, const Value &var);
+    // Only valid while the scope that the variable was declared in is. Assign to it with assign().
+    inline Value &variable(const VariableSlot &at){ return at.global ? *at.global : slots_[at.slot].value; }
+    // Adds to the outermost scope that is not frozen.
+    void addGlobal(const std::string &name, const Value &var);
+    // Assigns to an existing variable. Returns false if there is no such variable.
+    bool setVariable(const std::string &name, const Value &var);
+
+    // Pushes a function scope onto the frame stack. size is the number of variables it will
+    // probably need, and is only a hint.
+    void pushFrame(std::string::const_iterator start, std::string::const_iterator end, uint64_t size);
+    // Adds a variable to the innermost frame without checking for an existing one.
+    void addSlot(const std::string &name, const Value &var);
+    // Pops the innermost function scope, freeing its slots for the next call.
+    void popFrame();
 
-    struct Error {
-        enum Type { NoError, SyntaxError, ReferenceError, TypeError } type;
-        uint64_t line;
-        std::string what;
-    } error;
+    // Makes the global scopes of that visible to this Context, which must not have run anything
+    // yet. Assignments to them are shadowed in this Context's own global scope, as they are above
+    // a watermark, so that is only ever read. It must not run anything while this Context runs.
+    void viewGlobals(const Context &that);
+
+    // Freezes the current globals and heap. reset() returns here by discarding everything
+    // allocated or assigned since, without touching what came before.
+    void setWatermark();
+    void reset();
+
+    typedef Lithium::Error Error;
+    Error error;
 
     typedef Error::Type ErrT;
 
@@ -130,10 +249,23 @@ public:
         return false;
     }
 
-    inline bool setError(ErrT which, const std::string &what){ return setError(which, src_.line(), what); }
+    // The error is on the line that the source is at.
+    inline bool setError(ErrT which, const std::string &what){ return setError(which, program_.line(src_.offset()), what); }
+
+    // Fuel bounds how much a script can do before the host hears about it. Every call and every
+    // iteration of a loop burns one unit. When it runs out, the handler is called, and either
+    // calls setFuel and returns true to carry on, or returns false to fail the script with a
+    // ResourceError. Without a handler, running out fails the script. There is no limit until
+    // setFuel is called, and reset() does not refill it.
+    inline void setFuel(int64_t fuel){ fuel_ = fuel; }
+    // Never negative.
+    inline int64_t fuel() const { return fuel_ < 0 ? 0 : fuel_; }
+    inline void setFuelHandler(FuelHandler handler, void *user){ fuel_handler_ = handler; fuel_user_ = user; }
+    // Returns false, with the error set, if the script has to stop.
+    inline bool burn(){ return --fuel_ >= 0 || refuel(); }
 
-    static Value findObject(const std::string &name, std::vector<Scope>::iterator i, std::vector<Scope>::iterator end);
-    inline Value findObject(const std::string &name){ return findObject(name, scopes.begin(), scopes.end()); }
+    // Searches from the innermost scope outwards, and then the program's top-level functions.
+    Value findObject(const std::string &name);
 
 };
 
@@ -0,0 +1,104 @@
+#include "dict.hpp"
+#include <cassert>
+#include <cstring>
+
+namespace Lithium{
+
+static const uint64_t min_slots = 16llu;
+
+// The finalizer of splitmix64, so that sequential keys spread over the table.
+uint64_t Dict::hashInteger(int64_t i){
+    uint64_t x = i;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9llu;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebllu;
+    return x ^ (x >> 31);
+}
+
+Dict::Slot &Dict::probe(uint64_t hash, Value::Type key_type, int64_t integer, const char *data, uint64_t length){
+    assert(!slots_.empty());
+    const uint64_t mask = slots_.size() - 1;
+    for(uint64_t i = hash & mask; ; i = (i + 1) & mask){
+        Slot &slot = slots_[i];
+        if(slot.key_type==Value::Null)
+            return slot;
+        if(slot.hash!=hash || slot.key_type!=key_type)
+            continue;
+        if(key_type==Value::Integer ? slot.integer==integer :
+            slot.string.length()==length && !memcmp(slot.string.data(), data, length))
+            return slot;
+    }
+}
+
+void Dict::grow(){
+    std::vector<Slot> old(slots_.empty() ? min_slots : slots_.size() * 2);
+    old.swap(slots_);
+
+    const uint64_t mask = slots_.size() - 1;
+    for(Slot &slot : old){
+        if(slot.key_type==Value::Null)
+            continue;
+        uint64_t i = slot.hash & mask;
+        while(slots_[i].key_type!=Value::Null)
+            i = (i + 1) & mask;
+        slots_[i] = std::move(slot);
+    }
+}
+
+Value *Dict::find(const char *data, uint64_t length, uint64_t hash){
+    if(slots_.empty())
+        return nullptr;
+    Slot &slot = probe(hash, Value::String, 0ll, data, length);
+    return slot.key_type==Value::Null ? nullptr : &slot.value;
+}
+
+Value &Dict::insert(const char *data, uint64_t length, uint64_t hash){
+    if((size_ + 1) * 4 > slots_.size() * 3)
+        grow();
+    Slot &slot = probe(hash, Value::String, 0ll, data, length);
+    if(slot.key_type==Value::Null){
+        slot.hash = hash;
+        slot.key_type = Value::String;
+        slot.string.assign(data, length);
+        slot.value.type = Value::Null;
+        size_++;
+    }
+    return slot.value;
+}
+
+Value *Dict::find(int64_t key){
+    if(slots_.empty())
+        return nullptr;
+    Slot &slot = probe(hashInteger(key), Value::Integer, key, nullptr, 0llu);
+    return slot.key_type==Value::Null ? nullptr : &slot.value;
+}
+
+Value &Dict::insert(int64_t key){
+    if((size_ + 1) * 4 > slots_.size() * 3)
+        grow();
+    const uint64_t hash = hashInteger(key);
+    Slot &slot = probe(hash, Value::Integer, key, nullptr, 0llu);
+    if(slot.key_type==Value::Null){
+        slot.hash = hash;
+        slot.key_type = Value::Integer;
+        slot.integer = key;
+        slot.value.type = Value::Null;
+        size_++;
+    }
+    return slot.value;
+}
+
+const Value *Dict::find(const Value &key){
+    if(key.type==Value::Integer)
+        return find(key.value.integer);
+    assert(key.type==Value::String);
+    return find(key.value.string->data(), key.value.string->length(), key.value.string->hash());
+}
+
+Value &Dict::insert(const Value &key){
+    if(key.type==Value::Integer)
+        return insert(key.value.integer);
+    assert(key.type==Value::String);
+    return insert(key.value.string->data(), key.value.string->length(), key.value.string->hash());
+}
+
+} // namespace Lithium
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "variables.hpp"
+
+namespace Lithium{
+
+// A hash table keyed by strings and integers, for lookup tables too large for an Object.
+// The slots are one flat array, probed linearly and kept at most three quarters full. Every
+// slot keeps the hash of its key, so growing never hashes a string again, and a probe only
+// compares strings whose hashes match. Entries are never removed.
+//
+// All of the values in a Dict have the same type, which is given when it is created.
+class Dict{
+public:
+    struct Slot{
+        uint64_t hash;
+        // Integer or String, or Null for an empty slot.
+        Value::Type key_type;
+        int64_t integer;
+        std::string string;
+        Value value;
+    };
+
+private:
+    std::vector<Slot> slots_;
+    uint64_t size_;
+    Value::Type element_;
+
+    // Returns the slot holding the key, or the empty slot where it would go.
+    Slot &probe(uint64_t hash, Value::Type key_type, int64_t integer, const char *data, uint64_t length);
+    void grow();
+
+public:
+    Dict(Value::Type element) : size_(0llu), element_(element) {}
+
+    static uint64_t hashInteger(int64_t i);
+
+    // key must be an Integer or a String. Returns nullptr if the key is not present.
+    const Value *find(const Value &key);
+    // Returns the value for key, which is Null if it was not present.
+    Value &insert(const Value &key);
+
+    Value *find(const char *data, uint64_t length, uint64_t hash);
+    Value &insert(const char *data, uint64_t length, uint64_t hash);
+    Value *find(int64_t key);
+    Value &insert(int64_t key);
+
+    inline uint64_t size() const { return size_; }
+    inline Value::Type element() const { return element_; }
+    // Includes the empty slots, which have a key_type of Null.
+    inline const std::vector<Slot> &slots() const { return slots_; }
+};
+
+} // namespace Lithium
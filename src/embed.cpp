@@ -0,0 +1,87 @@
+#include "embed.hpp"
+#include "interpreter.hpp"
+
+namespace Lithium{
+
+Value ToValue(Context &ctx, const std::string &str){
+    Value val;
+    val.type = Value::String;
+    val.value.string = ctx.create<String>(Value::String, str);
+    if(!val.value.string)
+        val.type = Value::Null;
+    return val;
+}
+
+bool FromValue(const Value &val, int64_t &to){
+    Value x;
+    if(!CastValue(val, Value::Integer, x))
+        return false;
+    to = x.value.integer;
+    return true;
+}
+
+bool FromValue(const Value &val, float &to){
+    Value x;
+    if(!CastValue(val, Value::Floating, x))
+        return false;
+    to = x.value.floating;
+    return true;
+}
+
+bool FromValue(const Value &val, bool &to){
+    if(val.type!=Value::Boolean)
+        return false;
+    to = val.value.boolean;
+    return true;
+}
+
+bool FromValue(const Value &val, std::string &to){
+    if(val.type!=Value::String)
+        return false;
+    to = val.value.string->str();
+    return true;
+}
+
+void SetGlobal(Context &ctx, const std::string &name, const Value &val){
+    ctx.addGlobal(name, val);
+}
+
+bool GetGlobal(Context &ctx, const std::string &name, Value &to){
+    to = ctx.findObject(name);
+    return to.type!=Value::Null;
+}
+
+bool InitializeContext(Context &ctx){
+    if(!InterpretProgram(ctx))
+        return false;
+    ctx.setWatermark();
+    return true;
+}
+
+bool CallFunction(Context &ctx, const std::string &name, const Value *args, uint64_t num_args, Value &result){
+    const Value func = ctx.findObject(name);
+    if(func.type!=Value::Function)
+        return ctx.setError(Context::Error::ReferenceError, name + " is not a function");
+
+    const Function &function = *func.value.function;
+    if(num_args!=function.args.size())
+        return ctx.setError(Context::Error::TypeError, name + " takes " + std::to_string(function.args.size()) +
+            " arguments, but was called with " + std::to_string(num_args));
+
+    std::vector<Value> cast_args(num_args);
+    for(uint64_t i = 0; i<num_args; i++){
+        if(function.args[i].second.our_type==Value::Null)
+            cast_args[i] = args[i];
+        else if(!CastValue(args[i], function.args[i].second.our_type, cast_args[i]))
+            return ctx.setError(Context::Error::TypeError, std::string("Argument ") + std::to_string(i) + " is a " +
+                ValueName(args[i].type) + ", expected " + ValueName(function.args[i].second.our_type));
+    }
+
+    if(!InterpretFunction(ctx, function, cast_args.data()))
+        return false;
+
+    result = ctx.pop();
+    return true;
+}
+
+} // namespace Lithium
@@ -0,0 +1,75 @@
+#pragma once
+#include <string>
+#include "context.hpp"
+
+namespace Lithium{
+
+/*
+    The embedding API.
+
+    A host compiles a Program once, then keeps one Context per worker:
+
+        Program program(source);
+        Context ctx(program);
+        SetGlobal(ctx, "limit", ToValue(100));
+        InitializeContext(ctx);
+
+        for each request:
+            Value result;
+            if(CallFunction(ctx, "score", result, request.a, request.b))
+                FromValue(result, score);
+            ResetContext(ctx);
+
+    ResetContext discards everything the request allocated or assigned, and leaves the
+    globals as they were when InitializeContext returned.
+*/
+
+inline Value ToValue(const Value &val){ return val; }
+inline Value ToValue(int64_t i){ Value val; val.type = Value::Integer; val.value.integer = i; return val; }
+inline Value ToValue(int i){ return ToValue((int64_t)i); }
+inline Value ToValue(float f){ Value val; val.type = Value::Floating; val.value.floating = f; return val; }
+inline Value ToValue(double f){ return ToValue((float)f); }
+inline Value ToValue(bool b){ Value val; val.type = Value::Boolean; val.value.boolean = b; return val; }
+// Strings are allocated on the context's heap. Past its hard limit, this returns Null and sets
+// ctx.error.
+Value ToValue(Context &ctx, const std::string &str);
+
+// These return false if val is not of, or castable to, the requested type.
+bool FromValue(const Value &val, int64_t &to);
+bool FromValue(const Value &val, float &to);
+bool FromValue(const Value &val, bool &to);
+bool FromValue(const Value &val, std::string &to);
+
+// Adds to the globals. Before InitializeContext this is visible to the program's top-level
+// code. After it, the global only lasts until the next ResetContext.
+void SetGlobal(Context &ctx, const std::string &name, const Value &val);
+// An array, object or dict in to is emptied once no variable holds it, so it should be read
+// before the program assigns to the global again.
+bool GetGlobal(Context &ctx, const std::string &name, Value &to);
+
+// Runs the program's top-level code, then marks the result as the state to reset to.
+bool InitializeContext(Context &ctx);
+// Like InitializeContext, but restores the globals from the snapshot at snapshot_path if one
+// was written for this program. Otherwise the top-level code runs, and its globals are written
+// to snapshot_path for next time.
+bool InitializeContext(Context &ctx, const std::string &snapshot_path);
+inline void ResetContext(Context &ctx){ ctx.reset(); }
+
+// Writes the globals, and everything they reference, to a snapshot file.
+bool WriteSnapshot(Context &ctx, const std::string &path);
+// Adds the globals from a snapshot written for the same program, with the same natives. If the
+// snapshot does not match, this returns false without changing ctx.
+bool RestoreSnapshot(Context &ctx, const std::string &path);
+
+// Calls a function by name. Integer and Floating arguments are cast to the declared types.
+// On failure, ctx.error describes why.
+bool CallFunction(Context &ctx, const std::string &name, const Value *args, uint64_t num_args, Value &result);
+
+template<typename... Args>
+bool CallFunction(Context &ctx, const std::string &name, Value &result, const Args&... args){
+    // One extra element so that calls without arguments do not declare a zero-sized array.
+    const Value values[sizeof...(Args)+1] = { ToValue(args)... };
+    return CallFunction(ctx, name, values, sizeof...(Args), result);
+}
+
+} // namespace Lithium
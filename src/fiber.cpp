@@ -0,0 +1,187 @@
+#include "fiber.hpp"
+#include "embed.hpp"
+#include <algorithm>
+#include <cassert>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace Lithium{
+
+Fiber::Fiber(Scheduler &scheduler, Context &ctx, const std::string &function, const Value *args, uint64_t num_args)
+  : scheduler_(scheduler)
+  , ctx_(ctx)
+  , state_(Ready)
+  , stack_(nullptr)
+  , stack_size_(0llu)
+  , function_(function)
+  , args_(args, args + num_args){
+
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    const uint64_t size = ((std::max<uint64_t>(scheduler.stack_size_, page) + page - 1) / page + 1) * page;
+
+    // The lowest page is left unmapped, so that running off the end of the stack faults
+    // rather than writing over whatever is below it.
+    void *const stack = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+    if(stack==MAP_FAILED || mprotect(stack, page, PROT_NONE)!=0 || getcontext(&machine_)!=0){
+        if(stack!=MAP_FAILED)
+            munmap(stack, size);
+        state_ = Failed;
+        ctx_.setError(Context::Error::ReferenceError, "Could not allocate a stack for " + function);
+        return;
+    }
+
+    stack_ = stack;
+    stack_size_ = size;
+    machine_.uc_stack.ss_sp = stack;
+    machine_.uc_stack.ss_size = size;
+    machine_.uc_link = &scheduler.machine_;
+
+    // makecontext only passes ints, so the pointer is split in two.
+    const uint64_t self = reinterpret_cast<uintptr_t>(this);
+    makecontext(&machine_, reinterpret_cast<void(*)()>(entry), 2, unsigned(self >> 32), unsigned(self));
+}
+
+Fiber::~Fiber(){
+    freeStack();
+}
+
+void Fiber::entry(unsigned high, unsigned low){
+    Fiber &fiber = *reinterpret_cast<Fiber*>(uintptr_t((uint64_t(high) << 32) | low));
+    fiber.state_ = CallFunction(fiber.ctx_, fiber.function_, fiber.args_.data(), fiber.args_.size(), fiber.result_) ?
+        Done : Failed;
+    // Returning switches to uc_link, which is where run() last left off.
+}
+
+void Fiber::freeStack(){
+    if(stack_){
+        munmap(stack_, stack_size_);
+        stack_ = nullptr;
+    }
+}
+
+Scheduler::Scheduler(uint64_t stack_size)
+  : current_(nullptr)
+  , stack_size_(stack_size)
+  , slice_(0ll){}
+
+Scheduler::~Scheduler(){}
+
+Fiber *Scheduler::spawn(Context &ctx, const std::string &function, const Value *args, uint64_t num_args){
+    fibers_.emplace_back(new Fiber(*this, ctx, function, args, num_args));
+    Fiber *const fiber = fibers_.back().get();
+    if(fiber->state_==Fiber::Ready)
+        ready_.push_back(fiber);
+    if(slice_){
+        ctx.setFuel(slice_);
+        ctx.setFuelHandler(preempt, this);
+    }
+    return fiber;
+}
+
+uint64_t Scheduler::run(){
+    assert(current_==nullptr);
+
+    uint64_t runs = 0llu;
+    while(!ready_.empty()){
+        Fiber &fiber = *ready_.front();
+        ready_.pop_front();
+
+        fiber.state_ = Fiber::Running;
+        current_ = &fiber;
+        swapcontext(&machine_, &fiber.machine_);
+        current_ = nullptr;
+        runs++;
+
+        // Nothing will run on the stack again, so it can be given back before the host has
+        // looked at the result.
+        if(fiber.state_==Fiber::Done || fiber.state_==Fiber::Failed)
+            fiber.freeStack();
+    }
+    return runs;
+}
+
+void Scheduler::suspend(Fiber &fiber){
+    assert(current_==&fiber);
+    swapcontext(&fiber.machine_, &machine_);
+    // run() has switched back to this fiber.
+    assert(current_==&fiber);
+}
+
+bool Scheduler::pause(Context &ctx){
+    Fiber *const fiber = current_;
+    if(fiber==nullptr || &fiber->ctx_!=&ctx)
+        return false;
+
+    fiber->state_ = Fiber::Ready;
+    ready_.push_back(fiber);
+    suspend(*fiber);
+    return true;
+}
+
+bool Scheduler::resume(Fiber &fiber, const Value &value){
+    if(fiber.state_!=Fiber::Waiting)
+        return false;
+    fiber.resumed_ = value;
+    fiber.awaiting_ = Value();
+    fiber.state_ = Fiber::Ready;
+    ready_.push_back(&fiber);
+    return true;
+}
+
+void Scheduler::destroy(Fiber *fiber){
+    // A fiber that has not finished still has the interpreter's frames on its stack, and
+    // freeing them without unwinding would leak what they own.
+    assert(fiber->state_==Fiber::Done || fiber->state_==Fiber::Failed);
+    for(auto i = fibers_.begin(); i!=fibers_.end(); i++){
+        if(i->get()==fiber){
+            fibers_.erase(i);
+            return;
+        }
+    }
+}
+
+bool Scheduler::await(Context &ctx, const Value *args, uint64_t, Value &result, void *user){
+    Scheduler &scheduler = *static_cast<Scheduler*>(user);
+    Fiber *const fiber = scheduler.current_;
+    // Workers of the parallel builtins, and contexts that are not run by a fiber at all, have
+    // no stack of their own to suspend.
+    if(fiber==nullptr || &fiber->ctx_!=&ctx)
+        return ctx.setError(Context::Error::ReferenceError, "await can only be called from a fiber");
+
+    fiber->awaiting_ = args[0];
+    fiber->state_ = Fiber::Waiting;
+    scheduler.suspend(*fiber);
+
+    result = fiber->resumed_;
+    fiber->resumed_ = Value();
+    return true;
+}
+
+bool Scheduler::yield(Context &ctx, const Value *, uint64_t, Value &result, void *user){
+    if(!static_cast<Scheduler*>(user)->pause(ctx))
+        return ctx.setError(Context::Error::ReferenceError, "yield can only be called from a fiber");
+
+    result.type = Value::Integer;
+    result.value.integer = 0;
+    return true;
+}
+
+bool Scheduler::preempt(Context &ctx, void *user){
+    Scheduler &scheduler = *static_cast<Scheduler*>(user);
+    ctx.setFuel(scheduler.slice_);
+    // Outside of its fiber, as when the host calls into the Context itself, the slice is just
+    // refilled.
+    scheduler.pause(ctx);
+    return true;
+}
+
+bool Scheduler::addNatives(Program &program){
+    const TypeSpecifier any = {Value::Null, Value::Null, std::string(), {}};
+    const TypeSpecifier await_signature = {Value::Function, Value::Null, std::string(), {any}},
+        yield_signature = {Value::Function, Value::Integer, std::string(), {}};
+
+    return program.addNative("await", await_signature, await, this) &&
+        program.addNative("yield", yield_signature, yield, this);
+}
+
+} // namespace Lithium
@@ -0,0 +1,147 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <ucontext.h>
+#include "context.hpp"
+
+namespace Lithium{
+
+/*
+    Cooperative fibers, which let one thread run any number of script sessions that wait on
+    the host.
+
+    The interpreter keeps its state on the C stack, so each Fiber runs on a stack of its own
+    and is suspended by switching back to the Scheduler's. A script suspends itself with two
+    natives that Scheduler::addNatives adds:
+
+        call get await(<value>)     Suspends until the host resumes the fiber, and returns the
+                                    value that it was resumed with. The argument is given to the
+                                    host as Fiber::awaiting, to say what is being waited for.
+        call get yield()            Lets every other ready fiber run first. Returns 0.
+
+    A host that serves many sessions:
+
+        Scheduler scheduler;
+        scheduler.addNatives(program);
+        ...
+        Fiber *session = scheduler.spawn(ctx, "session", args, num_args);
+        scheduler.run();
+        while the session is Waiting:
+            scheduler.resume(*session, ToValue(session->context(), next_event));
+            scheduler.run();
+
+    A fiber can also be preempted when it runs out of fuel, either by giving the Scheduler a
+    time slice, or by a fuel handler of the host's own that calls pause.
+
+    A Scheduler and its fibers must only be used from one thread. Each fiber has a Context of
+    its own, which must outlive it and must not be used by anything else while it runs.
+*/
+
+class Scheduler;
+
+class Fiber{
+    friend class Scheduler;
+
+public:
+    enum State {
+        // Waiting for Scheduler::run to get to it.
+        Ready,
+        Running,
+        // Suspended in await until the host resumes it.
+        Waiting,
+        // The function returned, and result() holds what it returned.
+        Done,
+        // The function failed, and the context's error says why.
+        Failed
+    };
+
+private:
+    Scheduler &scheduler_;
+    Context &ctx_;
+    State state_;
+
+    ucontext_t machine_;
+    void *stack_;
+    uint64_t stack_size_;
+
+    std::string function_;
+    std::vector<Value> args_;
+    Value awaiting_, resumed_, result_;
+
+    Fiber(Scheduler &scheduler, Context &ctx, const std::string &function, const Value *args, uint64_t num_args);
+
+    static void entry(unsigned high, unsigned low);
+    void freeStack();
+
+public:
+    Fiber(const Fiber &that) = delete;
+    ~Fiber();
+
+    inline State state() const { return state_; }
+    inline Context &context() { return ctx_; }
+    // What the fiber passed to await, while it is Waiting.
+    inline const Value &awaiting() const { return awaiting_; }
+    // What the function returned, once the fiber is Done.
+    inline const Value &result() const { return result_; }
+};
+
+class Scheduler{
+    friend class Fiber;
+
+    std::vector<std::unique_ptr<Fiber> > fibers_;
+    std::deque<Fiber*> ready_;
+    Fiber *current_;
+    ucontext_t machine_;
+    const uint64_t stack_size_;
+    int64_t slice_;
+
+    // Switches from the running fiber back to run().
+    void suspend(Fiber &fiber);
+
+    static bool await(Context &ctx, const Value *args, uint64_t num_args, Value &result, void *user);
+    static bool yield(Context &ctx, const Value *args, uint64_t num_args, Value &result, void *user);
+    static bool preempt(Context &ctx, void *user);
+
+public:
+    static const uint64_t default_stack_size = 256llu * 1024llu;
+
+    // Each fiber's stack is stack_size bytes, which are only committed as they are used.
+    explicit Scheduler(uint64_t stack_size = default_stack_size);
+    Scheduler(const Scheduler &that) = delete;
+    ~Scheduler();
+
+    // Adds await and yield to program. Like Program::addNative, this must be done before any
+    // Context is created from it.
+    bool addNatives(Program &program);
+
+    // Fibers spawned after this is called are given slice fuel. Each time that a fiber burns it
+    // all, it is refilled and the fiber goes to the back of the Ready queue, as if it had
+    // yielded. This replaces the fiber's Context's fuel handler. 0, the default, turns it off.
+    inline void setTimeSlice(int64_t slice){ slice_ = slice; }
+
+    // Makes a Ready fiber that will call function in ctx with args, as CallFunction does.
+    Fiber *spawn(Context &ctx, const std::string &function, const Value *args, uint64_t num_args);
+
+    // Runs Ready fibers, each until it awaits, yields or finishes, until none are Ready.
+    // Returns the number of times that a fiber was run.
+    uint64_t run();
+
+    // Makes a Waiting fiber Ready, with value as the result of its await. A String, Array or
+    // Object must be allocated on the fiber's Context. Returns false if the fiber is not Waiting.
+    bool resume(Fiber &fiber, const Value &value);
+
+    // Suspends the running fiber, whose Context is ctx, as yield does. This is for fuel handlers,
+    // which are called on the fiber's stack. Returns false if ctx is not the running fiber's.
+    bool pause(Context &ctx);
+
+    // Frees a fiber that is Done or Failed.
+    void destroy(Fiber *fiber);
+
+    // The number of fibers that have not been destroyed.
+    inline uint64_t size() const { return fibers_.size(); }
+};
+
+} // namespace Lithium
@@ -0,0 +1,87 @@
+#include "heap.hpp"
+#include "dict.hpp"
+#include <algorithm>
+#include <map>
+#include <string>
+
+namespace Lithium{
+
+Heap::Heap(Metrics *metrics)
+  : head_(nullptr), frozen_(nullptr), count_(0llu), total_(0llu), metrics_(metrics), live_(0llu), peak_(0llu), soft_limit_(0llu), hard_limit_(0llu){
+    std::fill(bytes_, bytes_ + Value::Dict + 1, 0llu);
+    std::fill(peak_bytes_, peak_bytes_ + Value::Dict + 1, 0llu);
+}
+
+// These are estimates, which take constant time so that update() can be called on every write.
+// Strings held by the nodes or slots of a container, past their own storage, are not counted.
+uint64_t Heap::footprint(Value::Type type, const void *object){
+    typedef std::map<std::string, Value> Members;
+    // A red-black tree node is three pointers and a color ahead of its value.
+    static const uint64_t member_size = 4 * sizeof(void*) + sizeof(Members::value_type);
+    switch(type){
+        case Value::String:{
+            // A rope only holds its halves until it is flattened.
+            const String *const str = static_cast<const String*>(object);
+            return sizeof(String) + (str->isRope() ? 0llu : str->length());
+        }
+        case Value::Array:
+            return sizeof(std::vector<Value>) + static_cast<const std::vector<Value>*>(object)->capacity() * sizeof(Value);
+        case Value::Object:
+            return sizeof(Members) + static_cast<const Members*>(object)->size() * member_size;
+        case Value::Dict:
+            return sizeof(Dict) + static_cast<const Dict*>(object)->slots().capacity() * sizeof(Dict::Slot);
+        default:
+            return 0llu;
+    }
+}
+
+void Heap::charge(Block *block, uint64_t size){
+    live_ += size - block->size;
+    bytes_[block->type] += size - block->size;
+    LITHIUM_METRIC(metrics_->bytes_live += size - block->size);
+    block->size = size;
+
+    if(live_ > peak_)
+        peak_ = live_;
+    if(bytes_[block->type] > peak_bytes_[block->type])
+        peak_bytes_[block->type] = bytes_[block->type];
+    LITHIUM_METRIC(if(metrics_->bytes_live > metrics_->bytes_peak) metrics_->bytes_peak = metrics_->bytes_live);
+}
+
+bool Heap::update(const void *object){
+    Block *const b = block(object);
+    const uint64_t size = header_size + footprint(b->type, object);
+    if(hard_limit_ && size > b->size && live_ + (size - b->size) > hard_limit_)
+        return false;
+    charge(b, size);
+    return true;
+}
+
+void Heap::charge(const void *object){
+    Block *const b = block(object);
+    charge(b, header_size + footprint(b->type, object));
+}
+
+void Heap::rollback(Mark mark){
+    while(head_ && head_!=mark){
+        Block *const block = head_;
+        head_ = block->next;
+        // Whatever is left is older than the last freeze, so it is still frozen.
+        if(block==frozen_)
+            frozen_ = head_;
+        live_ -= block->size;
+        bytes_[block->type] -= block->size;
+        LITHIUM_METRIC(metrics_->bytes_live -= block->size);
+        block->destroy(object(block));
+        free(block);
+        count_--;
+    }
+}
+
+void Heap::freeze(){
+    for(Block *block = head_; block!=frozen_; block = block->next)
+        block->shared = true;
+    frozen_ = head_;
+}
+
+} // namespace Lithium
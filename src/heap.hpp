@@ -0,0 +1,172 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include "variables.hpp"
+#include "metrics.hpp"
+
+namespace Lithium{
+
+// Owns every payload (strings, objects, arrays) that a Context allocates.
+// Each allocation is linked onto a list, newest first. A watermark is just the head of that
+// list, so rolling back to a watermark destroys exactly the payloads allocated since it was
+// taken, and never looks at anything older.
+//
+// Arrays, objects and dicts are copied on write. Each counts the variables that hold it, and
+// has a flag that is set once it is stored in a container, or frozen, after which it is never
+// written in place again. Values on the operand stack are not counted, so the Context checks
+// those before a write. A write to a payload that something else may refer to goes to a copy.
+//
+// Every payload is charged, by its type, for an estimate of the memory it holds: its block,
+// the characters of a String that is not a rope, and the elements, nodes or slots of a
+// container. A payload that grows in place is charged again by update(). Past the soft limit
+// softLimited() turns true, so the host can wind the Context down at its next chance. Nothing
+// is allocated past the hard limit, and create() and update() return failure instead.
+class Heap{
+    struct Block{
+        Block *next;
+        void (*destroy)(void *object);
+        uint64_t size;
+        Value::Type type;
+        uint32_t refs;
+        bool shared;
+    };
+
+    // Keeps the object after the header correctly aligned.
+    static const uint64_t header_size = (sizeof(Block) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+    template<typename T>
+    static void destroy_(void *object){ static_cast<T*>(object)->~T(); }
+
+    static inline void *object(Block *block){ return reinterpret_cast<char*>(block) + header_size; }
+    static inline Block *block(const void *object){
+        return reinterpret_cast<Block*>(const_cast<char*>(static_cast<const char*>(object)) - header_size);
+    }
+
+    // The memory that a payload holds, itself included.
+    static uint64_t footprint(Value::Type type, const void *object);
+
+    Block *head_;
+    // Everything from here down was shared by the last freeze().
+    Block *frozen_;
+    uint64_t count_, total_;
+    Metrics *const metrics_;
+
+    uint64_t bytes_[Value::Dict+1], peak_bytes_[Value::Dict+1];
+    uint64_t live_, peak_;
+    uint64_t soft_limit_, hard_limit_;
+
+    void charge(Block *block, uint64_t size);
+    void release(Block *block);
+
+public:
+    typedef const void *Mark;
+
+    Heap(Metrics *metrics);
+    Heap(const Heap &that) = delete;
+    ~Heap(){ rollback(nullptr); }
+
+    // Returns nullptr, having allocated nothing, if the payload would take the heap past its
+    // hard limit.
+    template<typename T, typename... Args>
+    T *create(Value::Type type, Args&&... args){
+        Block *const block = static_cast<Block*>(malloc(header_size + sizeof(T)));
+        if(!block)
+            abort();
+        T *const payload = new (object(block)) T(std::forward<Args>(args)...);
+        const uint64_t size = header_size + footprint(type, payload);
+        if(hard_limit_ && live_ + size > hard_limit_){
+            payload->~T();
+            free(block);
+            return nullptr;
+        }
+
+        block->next = head_;
+        block->destroy = destroy_<T>;
+        block->size = 0llu;
+        block->type = type;
+        block->refs = 0u;
+        block->shared = false;
+        head_ = block;
+        count_++;
+        total_++;
+        LITHIUM_METRIC(metrics_->allocations[type]++);
+        charge(block, size);
+        return payload;
+    }
+
+    // Charges object for what it has grown or shrunk by since it was created or last updated.
+    // Returns false if that takes the heap past its hard limit. The object is left as it is,
+    // and is still freed by rollback.
+    bool update(const void *object);
+    // Like update(), but charges object even past the hard limit, for memory that it already
+    // holds, as a rope does once it is flattened. Nothing more can be allocated until the heap
+    // is back under its limit.
+    void charge(const void *object);
+
+    inline Mark mark() const { return head_; }
+
+    // object must have been allocated by a Heap. A payload that is already shared is only read,
+    // so Contexts on other threads can share what a frozen heap holds.
+    static inline void share(const void *object){
+        Block *const b = block(object);
+        if(!b->shared)
+            b->shared = true;
+    }
+    static inline bool shared(const void *object){ return block(object)->shared; }
+    // The array, object or dict that val holds, or nullptr. Strings are never written, so they
+    // are neither shared nor counted.
+    static inline const void *container(const Value &val){
+        switch(val.type){
+            case Value::Array: return val.value.array;
+            case Value::Object: return val.value.object;
+            case Value::Dict: return val.value.dict;
+            default: return nullptr;
+        }
+    }
+    // Counts the variables that hold a payload. A shared payload is not counted, since other
+    // threads may be reading it. release() returns true once nothing counts an unshared payload.
+    static inline void retain(const void *object){
+        Block *const b = block(object);
+        if(!b->shared)
+            b->refs++;
+    }
+    static inline bool release(const void *object){
+        Block *const b = block(object);
+        return !b->shared && b->refs && !--b->refs;
+    }
+    // Whether at most one variable holds the payload, and nothing else may refer to it.
+    static inline bool owned(const void *object){
+        const Block *const b = block(object);
+        return !b->shared && b->refs<=1u;
+    }
+    // Shares everything allocated so far, so that nothing older than a watermark is ever
+    // written in place. Strings are never written but to flatten and hash them, which is safe
+    // from any thread. Only what was allocated since the last freeze is walked.
+    void freeze();
+
+    // Destroys everything allocated since the mark was taken.
+    void rollback(Mark mark);
+
+    // The number of live allocations.
+    inline uint64_t count() const { return count_; }
+    // The number of allocations ever made.
+    inline uint64_t total() const { return total_; }
+
+    // 0 is no limit. Payloads that are already allocated are left alone, even if they are past
+    // the new limits.
+    inline void setLimits(uint64_t soft, uint64_t hard){ soft_limit_ = soft; hard_limit_ = hard; }
+    inline uint64_t softLimit() const { return soft_limit_; }
+    inline uint64_t hardLimit() const { return hard_limit_; }
+    inline bool softLimited() const { return soft_limit_ && live_ > soft_limit_; }
+
+    // The bytes charged to live payloads, in all and of one type, and the most there have been.
+    inline uint64_t bytes() const { return live_; }
+    inline uint64_t peakBytes() const { return peak_; }
+    inline uint64_t bytes(Value::Type type) const { return bytes_[type]; }
+    inline uint64_t peakBytes(Value::Type type) const { return peak_bytes_[type]; }
+};
+
+} // namespace Lithium
@@ -0,0 +1,244 @@
+#include "input.hpp"
+#include "interpreter.hpp"
+#include "numberparse.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Lithium{
+
+// Pages are given back this much at a time, rather than on every record.
+static const uint64_t release_step = 16llu * 1024llu * 1024llu;
+
+Input::Input(const std::string &path)
+  : fd_(open(path.c_str(), O_RDONLY)), data_(nullptr), size_(0llu), released_(0llu){
+    struct stat status;
+    if(fd_<0)
+        return;
+    if(fstat(fd_, &status)!=0){
+        close(fd_);
+        fd_ = -1;
+        return;
+    }
+
+    size_ = status.st_size;
+    // An empty file cannot be mapped, and has nothing to read anyway.
+    if(size_==0llu)
+        return;
+
+    void *const mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if(mapping==MAP_FAILED){
+        close(fd_);
+        fd_ = -1;
+        size_ = 0llu;
+        return;
+    }
+    data_ = static_cast<const char*>(mapping);
+    madvise(mapping, size_, MADV_SEQUENTIAL);
+}
+
+Input::~Input(){
+    if(data_)
+        munmap(const_cast<char*>(data_), size_);
+    if(fd_>=0)
+        close(fd_);
+}
+
+void Input::release(uint64_t offset){
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    offset -= offset % page;
+    if(offset < released_ + release_step)
+        return;
+    madvise(const_cast<char*>(data_) + released_, offset - released_, MADV_DONTNEED);
+    released_ = offset;
+}
+
+namespace{
+
+// The natives copy what they need out of args first, since calling anything can move the stack.
+
+bool checkCallback(Context &ctx, const char *name, const Function &func){
+    if(func.native)
+        return ctx.setError(Context::Error::TypeError, std::string(name) + " can only call script functions, not " + func.name);
+    if(func.args.size()!=1llu || func.args[0].second.our_type!=Value::String)
+        return ctx.setError(Context::Error::TypeError, std::string(name) + " needs a function that takes one string, but " +
+            func.name + " does not");
+    return true;
+}
+
+bool openInput(Context &ctx, const char *name, const Input &input, const std::string &path){
+    if(!input.valid())
+        return ctx.setError(Context::Error::ReferenceError, std::string(name) + " could not open " + path);
+    return true;
+}
+
+// Calls func with each record that next finds, and counts them in result. next is given the
+// rest of the file, and returns where the record ends and where the one after it starts.
+template<typename Next>
+bool forRecords(Context &ctx, Input &input, const Function &func, Value &result, const Next &next){
+    const char *at = input.data(), *const end = at + input.size();
+    int64_t count = 0;
+    while(at!=end){
+        const char *record_end, *following;
+        next(at, end, record_end, following);
+
+        const Heap::Mark mark = ctx.heap().mark();
+        Value record;
+        record.type = Value::String;
+        record.value.string = func.contained ?
+            ctx.create<String>(Value::String, String::View(at, record_end - at)) :
+            ctx.create<String>(Value::String, at, uint64_t(record_end - at));
+        if(!record.value.string)
+            return false;
+
+        if(!InterpretFunction(ctx, func, &record))
+            return false;
+        ctx.pop();
+        if(func.contained)
+            ctx.heap().rollback(mark);
+        input.release(following - input.data());
+
+        count++;
+        at = following;
+    }
+
+    result.type = Value::Integer;
+    result.value.integer = count;
+    return true;
+}
+
+// Lines end at "\n", and the "\r" of "\r\n" is not part of them.
+void nextLine(const char *at, const char *end, const char *&record_end, const char *&following){
+    const char *const newline = static_cast<const char*>(memchr(at, '\n', end - at));
+    following = newline ? newline + 1 : end;
+    record_end = newline ? newline : end;
+    if(record_end!=at && record_end[-1]=='\r')
+        record_end--;
+}
+
+bool inputLines(Context &ctx, const Value *args, uint64_t, Value &result, void *){
+    const std::string path = args[0].value.string->str();
+    const Function &func = *args[1].value.function;
+    if(!checkCallback(ctx, "input_lines", func))
+        return false;
+
+    Input input(path);
+    return openInput(ctx, "input_lines", input, path) &&
+        forRecords(ctx, input, func, result, nextLine);
+}
+
+bool inputRecords(Context &ctx, const Value *args, uint64_t, Value &result, void *){
+    const std::string path = args[0].value.string->str(), separator = args[1].value.string->str();
+    const Function &func = *args[2].value.function;
+    if(!checkCallback(ctx, "input_records", func))
+        return false;
+    if(separator.empty())
+        return ctx.setError(Context::Error::ReferenceError, "input_records needs a separator that is not empty");
+
+    Input input(path);
+    return openInput(ctx, "input_records", input, path) &&
+        forRecords(ctx, input, func, result,
+            [&separator](const char *at, const char *end, const char *&record_end, const char *&following){
+                const char *const found = static_cast<const char*>(memmem(at, end - at, separator.data(), separator.length()));
+                record_end = found ? found : end;
+                following = found ? found + separator.length() : end;
+            });
+}
+
+bool inputFixed(Context &ctx, const Value *args, uint64_t, Value &result, void *){
+    const std::string path = args[0].value.string->str();
+    const int64_t width = args[1].value.integer;
+    const Function &func = *args[2].value.function;
+    if(!checkCallback(ctx, "input_fixed", func))
+        return false;
+    if(width<=0)
+        return ctx.setError(Context::Error::ReferenceError, std::string("input_fixed needs a width above 0, not ") + std::to_string(width));
+
+    Input input(path);
+    return openInput(ctx, "input_fixed", input, path) &&
+        forRecords(ctx, input, func, result,
+            [width](const char *at, const char *end, const char *&record_end, const char *&following){
+                record_end = following = uint64_t(end - at) > uint64_t(width) ? at + width : end;
+            });
+}
+
+bool inputColumn(Context &ctx, const char *name, const Value *args, Value::Type element, Value &result){
+    const std::string path = args[0].value.string->str(), separator = args[1].value.string->str();
+    const int64_t column = args[2].value.integer;
+    if(separator.empty())
+        return ctx.setError(Context::Error::ReferenceError, std::string(name) + " needs a separator that is not empty");
+    if(column<0)
+        return ctx.setError(Context::Error::ReferenceError, std::string(name) + " needs a column of 0 or more, not " + std::to_string(column));
+
+    Input input(path);
+    if(!openInput(ctx, name, input, path))
+        return false;
+
+    std::vector<Value> *const values = ctx.create<std::vector<Value> >(Value::Array);
+    if(!values)
+        return false;
+
+    const char *at = input.data(), *const end = at + input.size();
+    for(uint64_t line = 1; at!=end; line++){
+        const char *line_end, *following;
+        nextLine(at, end, line_end, following);
+
+        // Skips to the start of the field.
+        const char *field = at;
+        for(int64_t c = 0; c<column && field; c++){
+            field = static_cast<const char*>(memmem(field, line_end - field, separator.data(), separator.length()));
+            if(field)
+                field += separator.length();
+        }
+
+        Value val;
+        const char *parsed = field;
+        if(!field || !ParseNumber(parsed, line_end, val))
+            return ctx.setError(Context::Error::TypeError, std::string(name) + " found no number in column " + std::to_string(column) +
+                " of line " + std::to_string(line) + " of " + path);
+        if(!CastValue(val, element, val))
+            return ctx.setError(Context::Error::TypeError, std::string(name) + " could not cast column " + std::to_string(column) +
+                " of line " + std::to_string(line) + " of " + path + " to " + ValueName(element));
+
+        const uint64_t capacity = values->capacity();
+        values->push_back(val);
+        if(values->capacity()!=capacity && !ctx.update(values, Value::Array))
+            return false;
+        input.release(following - input.data());
+        at = following;
+    }
+
+    result.type = Value::Array;
+    result.value.array = values;
+    return true;
+}
+
+bool inputIntColumn(Context &ctx, const Value *args, uint64_t, Value &result, void *){
+    return inputColumn(ctx, "input_int_column", args, Value::Integer, result);
+}
+
+bool inputFloatColumn(Context &ctx, const Value *args, uint64_t, Value &result, void *){
+    return inputColumn(ctx, "input_float_column", args, Value::Floating, result);
+}
+
+} // namespace
+
+bool Input::addNatives(Program &program){
+    const TypeSpecifier string = {Value::String, Value::Null, std::string(), {}},
+        integer = {Value::Integer, Value::Null, std::string(), {}},
+        function = {Value::Function, Value::Null, std::string(), {}};
+    const TypeSpecifier lines = {Value::Function, Value::Integer, std::string(), {string, function}},
+        records = {Value::Function, Value::Integer, std::string(), {string, string, function}},
+        fixed = {Value::Function, Value::Integer, std::string(), {string, integer, function}},
+        column = {Value::Function, Value::Array, std::string(), {string, string, integer}};
+
+    return program.addNative("input_lines", lines, inputLines) &&
+        program.addNative("input_records", records, inputRecords) &&
+        program.addNative("input_fixed", fixed, inputFixed) &&
+        program.addNative("input_int_column", column, inputIntColumn, nullptr, false) &&
+        program.addNative("input_float_column", column, inputFloatColumn, nullptr, false);
+}
+
+} // namespace Lithium
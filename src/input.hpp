@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include "context.hpp"
+
+namespace Lithium{
+
+/*
+    A file mapped into memory, and the input builtins that read one:
+
+        input_lines(string path, function f)                    -> the number of lines
+        input_records(string path, string separator, function f) -> the number of records
+        input_fixed(string path, int width, function f)          -> the number of records
+        input_int_column(string path, string separator, int column)   -> array int
+        input_float_column(string path, string separator, int column) -> array float
+
+    The first three call f with each record as a string, in order. Lines may end in "\n" or
+    "\r\n", and a last line without either still counts. Records of input_records are split
+    by every occurrence of the separator, and records of input_fixed are width bytes, of which
+    the last may be shorter.
+
+    When f is contained (see Program::analyzeEscapes), nothing it is given can outlive the
+    call, so each record is a view of the mapped file, and everything allocated for a record
+    is freed once f returns. A file of any size streams through in constant memory. f stays
+    contained when it counts or sums into outer variables, or prints, as long as it stores
+    no string, array, object or dict outside its frame. Otherwise each record is copied onto
+    the heap, where it stays like any other string.
+
+    The column builtins split each line by the separator and parse the field numbered column,
+    counting from 0, as a number literal. A line that is too short or does not hold a number
+    is an error.
+*/
+class Input{
+    int fd_;
+    const char *data_;
+    uint64_t size_, released_;
+
+public:
+    // Maps the file at path. valid() is false if it could not be.
+    explicit Input(const std::string &path);
+    Input(const Input &that) = delete;
+    ~Input();
+
+    inline bool valid() const { return fd_>=0; }
+    inline const char *data() const { return data_; }
+    inline uint64_t size() const { return size_; }
+
+    // Tells the kernel that the file before offset will not be read again, so that its pages
+    // can be dropped. Does nothing until there is enough to make it worthwhile.
+    void release(uint64_t offset);
+
+    // Adds the builtins to program. Like Program::addNative, this must be done before any
+    // Context is created from it.
+    static bool addNatives(Program &program);
+};
+
+} // namespace Lithium
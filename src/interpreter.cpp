@@ -1,6 +1,9 @@
 #include "interpreter.hpp"
 #include "numberparse.hpp"
+#include "profiler.hpp"
+#include "dict.hpp"
 #include <cassert>
+#include <functional>
 
 namespace Lithium {
 
@@ -11,6 +14,9 @@ static const std::string get_keyword("get"),
     if_keyword("if"),
     return_keyword("return"),
     up_keyword("up"),
+    object_keyword("object"),
+    loop_keyword("loop"),
+    for_keyword("for"),
 
     clone_keyword("clone"),
 
@@ -19,72 +25,69 @@ static const std::string get_keyword("get"),
     boolean_keyword("bool"),
     string_keyword("string"),
     array_keyword("array"),
+    dict_keyword("dict"),
     prototype_keyword("prototype");
 
-// A simple state machine that skips a scope.
+// Skips a scope using the program's scope table.
 // Accepts with ctx sitting on the ':', ends with ctx sitting on the '.'
 static void skip_scope(Context &ctx){
     assert(ctx.source().peekc()==':');
-    ctx.source().getc();
-    ctx.source().skipWhitespace();
-
-    bool in_string = false;
-    uint64_t scope_level = 1;
 
-    char c = ctx.source().peekc();
-have_char:
-    if(!ctx.source().valid())
-        return;
-
-    if(c=='"')
-        in_string=!in_string;
-    else if(in_string){
-        if(c=='\\')
-            ctx.source().getc();
-    }
-    else{
-        if(c=='.'){
-            if(!(--scope_level))
-                return;
-        }
-        else if(c==':')
-            scope_level++;
-        else if(c=='%')
-            while(ctx.source().valid() && ctx.source().peekc()!='\n')
-                ctx.source().getc();
-    }
-
-    c = ctx.source().getc();
-    goto have_char;
+    std::string::const_iterator close;
+    const bool found = ctx.program().scopeEnd(ctx.source().position(), close);
+    assert(found);
+    if(found)
+        ctx.source().position(close);
 }
 
   //  <program>        ::= [<statement> '\n']*
+// Stops at the end of input, at the '.' that closes the current scope, or after a return or up.
 bool InterpretProgram(Context &ctx){
-    while(ctx.source().skipWhitespace() &&
-        InterpretStatement(ctx)){
+    while(ctx.source().skipWhitespaceAndNewline() && ctx.source().peekc()!='.'){
+        if(!InterpretStatement(ctx))
+            return false;
+        if(ctx.unwinding)
+            return true;
+
         ctx.source().skipWhitespace();
-        if(ctx.source().peekc()!='\n')
-            break;
+        const char c = ctx.source().peekc();
+        if(c=='\n')
+            ctx.source().getc();
+        else if(c!='.' && ctx.source().valid())
+            return ctx.setError(Context::Error::SyntaxError, "Expected end of line after statement");
     }
     return true;
 }
 
-  //  <statement>      ::= <set> | <call> | <variable_decl> | <function_decl> | <if> | <loop> | <return> | <up>
+  //  <statement>      ::= <set> | <call> | <variable_decl> | <function_decl> | <if> | <loop> | <for> | <return> | <up>
 bool InterpretStatement(Context &ctx){
     Source start = ctx.source();
 
+    LITHIUM_METRIC(ctx.metrics.statements++);
+    if(ctx.profiler)
+        ctx.profiler->statement(ctx.program().offset(start.position()), ctx.heap().total());
+
     std::string ident;
     if(!ctx.source().getAlphaIdentifier(ident))
-        return false;
+        return ctx.setError(Context::Error::SyntaxError, "Expected statement");
 
     if(ident==set_keyword)
         return InterpretSet(ctx);
-    else if(ident==call_keyword)
-        return InterpretCall(ctx);
+    else if(ident==call_keyword){
+        // The result of a call statement is discarded.
+        if(!InterpretCall(ctx))
+            return false;
+        ctx.pop();
+        return true;
+    }
     else if(ident==function_keyword)
         return InterpretFunctionDeclaration(ctx);
     else if(ident==if_keyword)
         return InterpretIf(ctx);
+    else if(ident==loop_keyword)
+        return InterpretLoop(ctx);
+    else if(ident==for_keyword)
+        return InterpretFor(ctx);
     else if(ident==return_keyword)
         return InterpretReturn(ctx);
     else if(ident==up_keyword)
@@ -97,17 +100,161 @@ bool InterpretStatement(Context &ctx){
 }
 
   //  <set>            ::= 'set' <identifier> <expression> // NOTE <identifier> should really be the same as 'get' minus the keyword.
+// Marks an array, object or dict as reachable from a container, so that writes to it copy it.
+static inline void share(const Value &val){
+    if(const void *const payload = Heap::container(val))
+        Heap::share(payload);
+}
+
+// Reads the index of an access into container. Object members can be named directly, as in
+// get bar[int foo], and are put in member.
+static bool InterpretIndex(Context &ctx, const Value &container, Value &index, std::string &member){
+    if(container.type==Value::Object && Source::isAlpha(ctx.source().peekc())){
+        ctx.source().getIdentifier(member);
+        index.type = Value::String;
+        return true;
+    }
+
+    // The container waits on the stack, so that the index cannot free it.
+    Value pending = container;
+    ctx.push(pending);
+    if(!InterpretExpression(ctx))
+        return false;
+    index = ctx.pop();
+    ctx.pop();
+    if(container.type==Value::Object && index.type==Value::String)
+        member = index.value.string->str();
+    return true;
+}
+
+// Accepts with ctx sitting on the '[' after the name of the container. Writing to an index one
+// past the end of an array appends to it.
+static bool InterpretSetElement(Context &ctx, const std::string &name, Value container){
+    ctx.source().getc();
+    ctx.source().skipWhitespace();
+
+    if(container.type!=Value::Object && container.type!=Value::Array && container.type!=Value::Dict)
+        return ctx.setError( Context::Error::TypeError, std::string("Cannot assign to an element of a ") + ValueName(container.type) );
+
+    TypeSpecifier type;
+    if(!InterpretType(ctx, type))
+        return ctx.setError( Context::Error::SyntaxError, "Expected type specifier for set statement" );
+
+    ctx.source().skipWhitespace();
+
+    std::string member;
+    Value index = { Value::Null, {}};
+    if(!InterpretIndex(ctx, container, index, member))
+        return false;
+
+    ctx.source().skipWhitespace();
+    if(!ctx.source().match(']'))
+        return ctx.setError( Context::Error::SyntaxError, "Expected close bracket at the end of access" );
+    ctx.source().skipWhitespace();
+
+    // Likewise while the value is evaluated.
+    ctx.push(container);
+    if(!InterpretExpression(ctx))
+        return false;
+
+    const Value val = ctx.pop();
+    ctx.pop();
+    share(val);
+    if(val.type!=type.our_type)
+        return ctx.setError( Context::Error::TypeError, name + " is accessed as type " + ValueName(type.our_type) + " but is assigned a value of type " + ValueName(val.type) );
+
+    if(container.type==Value::Array){
+        if(index.type!=Value::Integer)
+            return ctx.setError( Context::Error::TypeError, std::string("Cannot access element of an array from a ") + ValueName(index.type) );
+        if(index.value.integer < 0)
+            return ctx.setError( Context::Error::ReferenceError, std::to_string(index.value.integer) + " is negative in Array assignment" );
+        if((uint64_t)index.value.integer > container.value.array->size())
+            return ctx.setError( Context::Error::ReferenceError, std::to_string(index.value.integer) +
+                " is past end of array of size " + std::to_string(container.value.array->size()) );
+        if(!container.value.array->empty() && container.value.array->front().type!=val.type)
+            return ctx.setError( Context::Error::TypeError, std::string("Invalid element of type ") + ValueName(val.type) +
+                ", expected " + ValueName(container.value.array->front().type) );
+
+        if(!ctx.owned(container.value.array)){
+            container.value.array = ctx.create<std::vector<Value> >(Value::Array, *container.value.array);
+            if(!container.value.array)
+                return false;
+            for(const Value &element : *container.value.array)
+                share(element);
+            ctx.setVariable(name, container);
+        }
+
+        std::vector<Value> &array = *container.value.array;
+        if((uint64_t)index.value.integer==array.size()){
+            array.push_back(val);
+            return ctx.update(&array, Value::Array);
+        }
+        array[index.value.integer] = val;
+    }
+    else if(container.type==Value::Dict){
+        if(index.type!=Value::Integer && index.type!=Value::String)
+            return ctx.setError( Context::Error::TypeError, std::string("Cannot use a ") + ValueName(index.type) + " as a dict key" );
+        if(container.value.dict->element()!=val.type)
+            return ctx.setError( Context::Error::TypeError, std::string("Invalid element of type ") + ValueName(val.type) +
+                ", expected " + ValueName(container.value.dict->element()) );
+
+        if(!ctx.owned(container.value.dict)){
+            container.value.dict = ctx.create<Dict>(Value::Dict, *container.value.dict);
+            if(!container.value.dict)
+                return false;
+            for(const Dict::Slot &slot : container.value.dict->slots())
+                share(slot.value);
+            ctx.setVariable(name, container);
+        }
+
+        container.value.dict->insert(index) = val;
+        return ctx.update(container.value.dict, Value::Dict);
+    }
+    else{
+        if(index.type!=Value::String)
+            return ctx.setError( Context::Error::TypeError, std::string("Cannot access element of an object from a ") + ValueName(index.type) );
+
+        if(!ctx.owned(container.value.object)){
+            container.value.object = ctx.create<std::map<std::string, Value> >(Value::Object, *container.value.object);
+            if(!container.value.object)
+                return false;
+            for(const std::pair<const std::string, Value> &m : *container.value.object)
+                share(m.second);
+            ctx.setVariable(name, container);
+        }
+
+        (*container.value.object)[member] = val;
+        return ctx.update(container.value.object, Value::Object);
+    }
+
+    return true;
+}
+
+  //  <set>            ::= 'set' <identifier> ['[' <type> <index> ']'] <expression>
 bool InterpretSet(Context &ctx){
     
     std::string name;
     if(!ctx.source().getIdentifier(name))
-        return false;
+        return ctx.setError(Context::Error::SyntaxError, "Expected variable name for set");
+
+    const Value old = ctx.findObject(name);
+    if(old.type==Value::Null)
+        return ctx.setError(Context::Error::ReferenceError, std::string("Assignment to undefined variable ") + name);
+
+    ctx.source().skipWhitespace();
+
+    if(ctx.source().peekc()=='[')
+        return InterpretSetElement(ctx, name, old);
 
     if(!InterpretExpression(ctx))
-        return ctx.setError(Context::Error::SyntaxError, "Expected variable name for set");
+        return false;
 
-    ctx.addVariable(name, ctx.top());
-    ctx.pop();
+    const Value val = ctx.pop();
+    if(val.type!=old.type)
+        return ctx.setError(Context::Error::TypeError, name + " is of type " + ValueName(old.type) + " but is assigned a value of type " + ValueName(val.type));
+
+    if(!ctx.setVariable(name, val))
+        return ctx.setError(Context::Error::ReferenceError, std::string("Cannot assign to ") + name);
 
     return true;
 }
@@ -121,52 +268,96 @@ bool InterpretCall(Context &ctx){
     if(ctx.top().type!=Value::Function)
         return ctx.setError(Context::Error::TypeError, "Value is not a function");
 
-    Value function = ctx.pop();
+    const Function &function = *ctx.pop().value.function;
 
     ctx.source().skipWhitespace();
 
     if(!ctx.source().match('('))
         return ctx.setError(Context::Error::SyntaxError, "Expected start of argument list");
 
-    std::vector<Value> args; args.reserve(function.value.function->args.size());
+    // The arguments are left on the stack, and passed to the function from there.
+    const uint64_t args = ctx.stackSize();
 
-    for(const std::pair<std::string, TypeSpecifier> &i : function.value.function->args){
+    for(const std::pair<std::string, TypeSpecifier> &i : function.args){
         ctx.source().skipWhitespace();
 
+        const uint64_t num = ctx.stackSize() - args;
+        if(num){
+            if(!ctx.source().match(','))
+                return ctx.setError(Context::Error::SyntaxError, "Expected comma before next argument");
+            ctx.source().skipWhitespace();
+        }
+
         if(!InterpretExpression(ctx))
             return false;
 
-        if(ctx.top().type!=i.second.our_type)
+        // Natives can take an argument of any type, which is marked by a type of Null.
+        if(ctx.top().type!=i.second.our_type && i.second.our_type!=Value::Null)
             return ctx.setError(Context::Error::TypeError, 
-                std::string("Argument") + std::to_string(args.size()) + " is a " + ValueName(ctx.top().type) + ", expected " + ValueName(i.second.our_type));
-
-        args.push_back(ctx.pop());
-
-        ctx.source().skipWhitespace();
-
-        if(!ctx.source().match(','))
-            return ctx.setError(Context::Error::SyntaxError, "Expected comma before next argument");
+                std::string("Argument ") + std::to_string(num) + " is a " + ValueName(ctx.top().type) + ", expected " + ValueName(i.second.our_type));
     }
 
     ctx.source().skipWhitespace();
     if(!ctx.source().match(')'))
             return ctx.setError(Context::Error::SyntaxError, "Expected close paren after argument");
 
-    assert(args.size() == function.value.function->args.size());
+    assert(ctx.stackSize() - args == function.args.size());
 
-    // Setup the new scope
-    Value val;
-    val.type = Value::Object;
-    val.value.object = new std::map<std::string, Value>();
+    if(!InterpretFunction(ctx, function, ctx.stackAt(args)))
+        return false;
+
+    Value result = ctx.pop();
+    ctx.drop(function.args.size());
+    ctx.push(result);
+    return true;
+}
 
-    for(uint64_t i = 0; i<args.size(); i++){
-        val.value.object->insert({function.value.function->args[i].first, args[i]});
+bool InterpretFunction(Context &ctx, const Function &function, const Value *args){
+    LITHIUM_METRIC(ctx.metrics.calls++);
+    if(!ctx.burn())
+        return false;
+
+    if(function.native){
+        if(ctx.profiler)
+            ctx.profiler->enter(function, ctx.heap().total());
+
+        Value result = {Value::Null, {}};
+        if(!function.native(ctx, args, function.args.size(), result, function.user)){
+            if(ctx.error.type==Context::Error::NoError)
+                return ctx.setError(Context::Error::ReferenceError, std::string("Native function ") + function.name + " failed");
+            return false;
+        }
+
+        if(result.type!=function.return_type && !(function.return_type==Value::Null && result.type!=Value::Null))
+            return ctx.setError(Context::Error::TypeError, function.name + " returns " + ValueName(function.return_type) +
+                " but returned a value of type " + ValueName(result.type));
+        ctx.push(result);
+
+        if(ctx.profiler)
+            ctx.profiler->leave(ctx.heap().total());
+        return true;
     }
 
-    const uint64_t scope_num = ctx.scopes.size();
+    const Source caller = ctx.source();
+    const uint64_t stack_size = ctx.stackSize();
+    const Heap::Mark frame = ctx.heap().mark();
 
-    ctx.scopes.push_back({ctx.source().position(), ctx.source().position(), val});
-    ctx.source().position(function.value.function->start);
+    // Setup the new scope
+    ctx.pushFrame(function.start, caller.position(), function.args.size() + function.locals);
+    // Arguments from a call stay on the stack until it returns, so writes to them are copied,
+    // and a contained function never writes to anything older than its frame in place. Those
+    // passed by the host or a native may still be held there, and are shared instead.
+    const bool on_stack = !std::less<const Value*>()(args, ctx.stackAt(0)) && std::less<const Value*>()(args, ctx.stackAt(stack_size));
+    for(uint64_t i = 0; i<function.args.size(); i++){
+        if(!on_stack)
+            share(args[i]);
+        ctx.addSlot(function.args[i].first, args[i]);
+    }
+
+    ctx.source().position(function.start);
+
+    if(ctx.profiler)
+        ctx.profiler->enter(function, ctx.heap().total());
 
     if(!ctx.source().match(':'))
         return ctx.setError(Context::Error::SyntaxError, "Expected colon at start of function");
@@ -174,11 +365,30 @@ bool InterpretCall(Context &ctx){
     if(!InterpretProgram(ctx))
         return false;
 
-    if(!(ctx.source().skipWhitespace() && ctx.source().match('.')))
-        return ctx.setError(Context::Error::SyntaxError, "Expected dot at close of function");
+    if(!ctx.unwinding)
+        return ctx.setError(Context::Error::SyntaxError, std::string("Expected return statement in function ") + function.name);
+
+    assert(ctx.stackSize()==stack_size+1);
+    if(ctx.stackSize()!=stack_size+1)
+        return ctx.setError(Context::Error::SyntaxError, "(INTERNAL) Unbalanced stack after return");
 
-    if(scope_num!=ctx.scopes.size())
-        return ctx.setError(Context::Error::SyntaxError, "Expected return statement in function");
+    if(ctx.top().type!=function.return_type && ctx.top().type!=Value::Null)
+        return ctx.setError(Context::Error::TypeError, function.name + " returns " + ValueName(function.return_type) +
+            " but returned a value of type " + ValueName(ctx.top().type));
+
+    ctx.unwinding = false;
+    ctx.popFrame();
+    ctx.source() = caller;
+
+    // The result is not on the heap, and nothing else allocated by the call can be reached.
+    if(function.contained){
+        LITHIUM_METRIC(ctx.metrics.frame_frees += ctx.heap().count());
+        ctx.heap().rollback(frame);
+        LITHIUM_METRIC(ctx.metrics.frame_frees -= ctx.heap().count());
+    }
+
+    if(ctx.profiler)
+        ctx.profiler->leave(ctx.heap().total());
 
     return true;
 }
@@ -232,32 +442,43 @@ bool InterpretIf(Context &ctx){
 */
 
 bool InterpretIf(Context &ctx){
-    const uint64_t if_line = ctx.source().line();
+    const uint64_t if_at = ctx.source().offset();
     if(!InterpretExpression(ctx))
         return false;
     if(!ConditionalType(ctx))
         return false;
-    if(!ConditionalSuccess(ctx.pop())){
+
+    ctx.source().skipWhitespace();
+    if(ctx.source().peekc()!=':')
+        return ctx.setError(Context::Error::SyntaxError, "Expected start of scope after if statement");
+
+    if(!ConditionalSuccess(ctx.pop()))
         skip_scope(ctx);
-        return true;
-    }
     else if(!InterpretScope(ctx))
         return false;
-    else if(!ctx.source().match('.'))
-        return ctx.setError(Context::Error::SyntaxError, std::string("Expected end of scope after if statement on line ") + std::to_string(if_line));
+    else if(ctx.unwinding)
+        return true;
+
+    if(!ctx.source().match('.'))
+        return ctx.setError(Context::Error::SyntaxError, std::string("Expected end of scope after if statement on line ") + std::to_string(ctx.program().line(if_at) + 1));
 
     return true;
 }
 
-// TODO
+  //  <loop>           ::= 'loop' <expression> <scope>
 bool InterpretLoop(Context &ctx){
 
-    Source start = ctx.source();
+    const std::string::const_iterator start = ctx.source().position();
     do{
         if(!InterpretExpression(ctx))
             return false;
         if(!ConditionalType(ctx))
             return false;
+
+        ctx.source().skipWhitespace();
+        if(ctx.source().peekc()!=':')
+            return ctx.setError(Context::Error::SyntaxError, "Expected start of scope after loop");
+
         if(!ConditionalSuccess(ctx.pop())){
             skip_scope(ctx);
             break;
@@ -265,30 +486,131 @@ bool InterpretLoop(Context &ctx){
         else{
             if(!InterpretScope(ctx))
                 return false;
-            ctx.source() = start;
+            if(ctx.unwinding)
+                return true;
+            if(!ctx.burn())
+                return false;
+            ctx.source().position(start);
         }
     }while(true);
 
     if(!ctx.source().match('.'))
-        return ctx.setError(Context::Error::SyntaxError, std::string("Expected end of scope after loop on line ") + std::to_string(start.line()));
+        return ctx.setError(Context::Error::SyntaxError, std::string("Expected end of scope after loop on line ") + std::to_string(ctx.program().line(ctx.program().offset(start)) + 1));
+
+    return true;
+}
+
+  //  <for>            ::= 'for' <type> <identifier> <expression> [',' <expression>] <scope>
+// Counts from the first expression up to, but not including, the second, or from 0 if there is
+// only one. If the only expression is an array, the variable is each of its elements in turn.
+// The bounds are evaluated and checked once, and the variable is assigned through its slot
+// rather than by name, so assigning to it in the body does not change the next value. The
+// variable is only declared if the body runs.
+bool InterpretFor(Context &ctx){
+    const uint64_t for_at = ctx.source().offset();
+
+    TypeSpecifier type;
+    if(!InterpretType(ctx, type))
+        return ctx.setError(Context::Error::SyntaxError, "Expected type specifier for loop variable");
+
+    std::string name;
+    if(!ctx.source().getIdentifier(name))
+        return ctx.setError(Context::Error::SyntaxError, "Expected name of loop variable");
+
+    ctx.source().skipWhitespace();
+    if(!InterpretExpression(ctx))
+        return false;
+    const Value first = ctx.pop();
+    ctx.source().skipWhitespace();
+
+    const std::vector<Value> *array = nullptr;
+    int64_t begin = 0ll, end = 0ll;
+    if(first.type==Value::Array){
+        // Holding the array makes writes in the body copy it rather than change what is being
+        // iterated.
+        ctx.retain(first);
+        array = first.value.array;
+        if(!array->empty() && array->front().type!=type.our_type)
+            return ctx.setError(Context::Error::TypeError, name + " is of type " + ValueName(type.our_type) +
+                " but loops over an Array of " + ValueName(array->front().type));
+        end = array->size();
+    }
+    else if(first.type==Value::Integer){
+        if(type.our_type!=Value::Integer)
+            return ctx.setError(Context::Error::TypeError, name + " is of type " + ValueName(type.our_type) + " but loops over a range of Integer");
+
+        end = first.value.integer;
+        if(ctx.source().peekc()==','){
+            ctx.source().getc();
+            ctx.source().skipWhitespace();
+            if(!InterpretExpression(ctx))
+                return false;
+            const Value last = ctx.pop();
+            if(last.type!=Value::Integer)
+                return ctx.setError(Context::Error::TypeError, std::string("End of range is a ") + ValueName(last.type) + ", expected Integer");
+            begin = first.value.integer;
+            end = last.value.integer;
+            ctx.source().skipWhitespace();
+        }
+    }
+    else
+        return ctx.setError(Context::Error::TypeError, std::string("Cannot loop over a ") + ValueName(first.type));
+
+    if(ctx.source().peekc()!=':')
+        return ctx.setError(Context::Error::SyntaxError, "Expected start of scope after for");
+
+    if(begin>=end)
+        skip_scope(ctx);
+    else{
+        const std::string::const_iterator body = ctx.source().position();
+        const VariableSlot at = ctx.declareVariable(name, first);
+        for(int64_t i = begin; i<end; i++){
+            Value &var = ctx.variable(at);
+            if(array){
+                share((*array)[i]);
+                ctx.assign(var, (*array)[i]);
+            }
+            else{
+                var.type = Value::Integer;
+                var.value.integer = i;
+            }
+
+            ctx.source().position(body);
+            if(!InterpretScope(ctx))
+                return false;
+            if(ctx.unwinding)
+                break;
+            if(!ctx.burn())
+                return false;
+        }
+    }
+    if(array)
+        ctx.release(first);
+    if(ctx.unwinding)
+        return true;
+
+    if(!ctx.source().match('.'))
+        return ctx.setError(Context::Error::SyntaxError, std::string("Expected end of scope after for on line ") + std::to_string(ctx.program().line(for_at) + 1));
 
     return true;
 }
 
+// The enclosing InterpretFunction pops the scope and returns to the caller.
 bool InterpretReturn(Context &ctx){
 
     if(!InterpretExpression(ctx))
         return false;
-    ctx.source().position(ctx.scopes.back().end);
-    ctx.scopes.pop_back();
+    ctx.unwinding = true;
 
     return true;
 }
 
+// Returns without a value.
 bool InterpretUp(Context &ctx){
 
-    ctx.source().position(ctx.scopes.back().end);
-    ctx.scopes.pop_back();
+    Value null = {Value::Null, {}};
+    ctx.push(null);
+    ctx.unwinding = true;
 
     return true;
 }
@@ -308,10 +630,18 @@ bool InterpretExpression(Context &ctx){
                 return false;
             Value second = ctx.pop();
 
+            if(c=='+' && first.type==Value::String && second.type==Value::String){
+                first.value.string = ctx.create<String>(Value::String, *first.value.string, *second.value.string, &ctx.heap());
+                if(!first.value.string)
+                    return false;
+                ctx.push(first);
+                continue;
+            }
+
             Value::Type mutual_cast = MutualCast(first, second);
             bool is_arith = TypeIsArithmetic(mutual_cast);
             if(!is_arith)
-                return ctx.setError( Context::Error::TypeError, std::string("Types ") + ValueName(first.type) + " and " + ValueName(first.type) + " are not valid for arithmetic");
+                return ctx.setError( Context::Error::TypeError, std::string("Types ") + ValueName(first.type) + " and " + ValueName(second.type) + " are not valid for arithmetic");
 
             MutualCastValue(first, second, mutual_cast);
 
@@ -348,7 +678,7 @@ bool InterpretTerm(Context &ctx){
             Value::Type mutual_cast = MutualCast(first, second);
             bool is_arith = TypeIsArithmetic(mutual_cast);
             if(!is_arith)
-                return ctx.setError( Context::Error::TypeError, std::string("Types ") + ValueName(first.type) + " and " + ValueName(first.type) + " are not valid for arithmetic");
+                return ctx.setError( Context::Error::TypeError, std::string("Types ") + ValueName(first.type) + " and " + ValueName(second.type) + " are not valid for arithmetic");
 
             MutualCastValue(first, second, mutual_cast);
 
@@ -367,34 +697,6 @@ bool InterpretTerm(Context &ctx){
     return true;
 }
 
-enum e_bitop { z, shr, shl, ror, rol, bor, band, bxor };
-
-inline bool is_double_char_bitop(e_bitop b){
-    return b==bor || b==band || b==bxor;
-}
-
-inline e_bitop is_bitop(char c1, char c2){
-    if(c1!=c2){
-        if(c1=='|' && c2=='>')
-            return ror;
-        if(c1=='<' && c2=='|')
-            return rol;
-        if(c1=='|')
-            return bor;
-        if(c1=='&')
-            return band;
-        if(c1=='^')
-            return bxor;
-    }
-    else{
-        if(c1=='>')
-            return shr;
-        if(c1=='<')
-            return shl;
-    }
-    return z;
-}
-
 bool InterpretFactor(Context &ctx){
     if(!InterpretValue(ctx))
         return false;
@@ -404,8 +706,6 @@ bool InterpretFactor(Context &ctx){
         const char c1 = start.getc();
         const char c2 = start.getc();
 
-        if(!start.valid())
-            return ctx.setError( Context::Error::SyntaxError, "Unexpected end of input" );
         if(e_bitop e = is_bitop(c1, c2)){
             ctx.source().getc();
             if(is_double_char_bitop(e))
@@ -420,7 +720,7 @@ bool InterpretFactor(Context &ctx){
             Value::Type mutual_cast = MutualCast(first, second);
             bool is_arith = TypeIsArithmetic(mutual_cast);
             if(!is_arith)
-                return ctx.setError( Context::Error::TypeError, std::string("Types ") + ValueName(first.type) + " and " + ValueName(first.type) + " are not valid for arithmetic");
+                return ctx.setError( Context::Error::TypeError, std::string("Types ") + ValueName(first.type) + " and " + ValueName(second.type) + " are not valid for arithmetic");
 
             MutualCastValue(first, second, mutual_cast);
 
@@ -516,14 +816,15 @@ bool InterpretGet(Context &ctx){
     Value val = ctx.findObject(ident);
     if(val.type==Value::Null)
         return ctx.setError( Context::Error::ReferenceError, std::string("Reference to undefined variable ") + ident );
-    else if(val.type!=Value::Object && val.type!=Value::Object && val.type!=Value::Object)
-        return ctx.setError( Context::Error::TypeError, std::string("Cannot fetch from a ") + ValueName(val.type) );
 
     ctx.source().skipWhitespace();
 
     if(ctx.source().peekc()=='['){
         ctx.source().getc();
 
+        if(val.type!=Value::Object && val.type!=Value::Array && val.type!=Value::String && val.type!=Value::Dict)
+            return ctx.setError( Context::Error::TypeError, std::string("Cannot fetch from a ") + ValueName(val.type) );
+
         ctx.source().skipWhitespace();
         TypeSpecifier type;
         // TODO: Make typing strict here.
@@ -535,13 +836,17 @@ bool InterpretGet(Context &ctx){
             if(val.value.array->back().type!=type.our_type)
                 return ctx.setError( Context::Error::TypeError, std::string("Invalid fetch of type ") + ValueName(type.our_type) +
                 " from Array holding type " + ValueName(val.value.array->back().type) );
+        if(val.type==Value::Dict && val.value.dict->element()!=type.our_type)
+            return ctx.setError( Context::Error::TypeError, std::string("Invalid fetch of type ") + ValueName(type.our_type) +
+                " from Dict holding type " + ValueName(val.value.dict->element()) );
 
         ctx.source().skipWhitespace();
 
-        if(!InterpretExpression(ctx))
+        std::string member;
+        Value index = { Value::Null, {}};
+        if(!InterpretIndex(ctx, val, index, member))
             return false;
 
-        Value index = ctx.pop();
         Value fetch = { Value::Null, {}};
 
         switch(val.type){
@@ -565,20 +870,33 @@ bool InterpretGet(Context &ctx){
                     return ctx.setError( Context::Error::ReferenceError, std::to_string(index.value.integer) + 
                         " is past end of array of size " + std::to_string(val.value.string->length()) );
                 fetch.type = Value::Integer;
-                fetch.value.integer = val.value.string->at(index.value.integer);
+                fetch.value.integer = (*val.value.string)[index.value.integer];
                 break;
             case Value::Object:
                 if(index.type!=Value::String)
                     return ctx.setError( Context::Error::TypeError, std::string("Cannot access element of an object from a ") + ValueName(index.type) );
 
                 {
-                    auto x =  val.value.object->find(index.value.string[0]);
+                    auto x =  val.value.object->find(member);
                     if(x == val.value.object->cend())
-                        return ctx.setError( Context::Error::ReferenceError, std::string("No such element '") + index.value.string[0] + '\'' );
+                        return ctx.setError( Context::Error::ReferenceError, std::string("No such element '") + member + '\'' );
                     else
                         fetch = x->second;
                 }
                 break;
+            case Value::Dict:
+                if(index.type!=Value::Integer && index.type!=Value::String)
+                    return ctx.setError( Context::Error::TypeError, std::string("Cannot use a ") + ValueName(index.type) + " as a dict key" );
+
+                {
+                    const Value *const x = val.value.dict->find(index);
+                    if(!x)
+                        return ctx.setError( Context::Error::ReferenceError, index.type==Value::Integer ?
+                            std::string("No such key ") + std::to_string(index.value.integer) :
+                            std::string("No such key '") + index.value.string->str() + '\'' );
+                    fetch = *x;
+                }
+                break;
             default:
                 assert(false);
         }
@@ -589,8 +907,9 @@ bool InterpretGet(Context &ctx){
 
         // TODO: Make typing strict here.
         if(fetch.type!=type.our_type)
-            return ctx.setError( Context::Error::TypeError, ident + " is type " + ValueName(val.type) + " but was accessed as type " + ValueName(type.our_type) );
+            return ctx.setError( Context::Error::TypeError, ident + " holds type " + ValueName(fetch.type) + " but was accessed as type " + ValueName(type.our_type) );
 
+        share(fetch);
         ctx.push(fetch);
 
         ctx.source().skipWhitespace();
@@ -610,15 +929,14 @@ bool InterpretGet(Context &ctx){
 bool InterpretStringLiteral(Context &ctx){
 
     ctx.source().skipWhitespace();
-    std::string *str = new std::string();
-    if(!ctx.source().getStringLiteral(str[0])){
-        delete str;
+    const Program::StringConstant *constant = ctx.program().stringConstant(ctx.source().position());
+    if(!constant)
         return ctx.setError( Context::Error::SyntaxError, "Expected string literal.");
-    }
 
+    ctx.source().position(ctx.program().source().cbegin() + constant->end);
     ctx.source().skipWhitespace();
 
-    Value val; val.type = Value::String; val.value.string = str;
+    Value val; val.type = Value::String; val.value.string = ctx.program().stringValue(*constant);
     ctx.push(val);
     return true;
 }
@@ -649,97 +967,186 @@ bool InterpretBooleanLiteral(Context &ctx){
     return true;
 }
 
-bool InterpretArrayLiteral(Context &ctx){
+// Reads comma separated elements of the given type up to and including close.
+static bool InterpretArrayElements(Context &ctx, Value::Type element, char close){
+    std::vector<Value> *const array = ctx.create<std::vector<Value> >(Value::Array);
+    if(!array)
+        return false;
+
     ctx.source().skipWhitespace();
-    if(ctx.source().peekc()=='{'){
 
+    while(ctx.source().peekc()!=close){
+        if(!array->empty()){
+            if(!ctx.source().match(','))
+                return ctx.setError( Context::Error::SyntaxError, "Expected comma or end of array literal after element" );
+            ctx.source().skipWhitespace();
+        }
+
+        if(!InterpretExpression(ctx))
+            return false;
 
+        if(element!=ctx.top().type)
+            return ctx.setError( Context::Error::TypeError, std::string("Invalid element of type ") + ValueName(ctx.top().type) + ", expected " + ValueName(element) );
 
-    }
-    else{
-        std::string prototype;
-        ctx.source().getIdentifier(prototype);
+        share(ctx.top());
+        array->push_back(ctx.pop());
 
+        ctx.source().skipWhitespace();
+        if(!ctx.source().valid())
+            return ctx.setError( Context::Error::SyntaxError, "Array literal is never closed" );
     }
-        return ctx.setError( Context::Error::SyntaxError, "Expected array literal" );
 
-    std::unique_ptr<std::vector<Value>> array(new std::vector<Value>());
+    ctx.source().getc();
+    if(!ctx.update(array, Value::Array))
+        return false;
 
-    ctx.source().skipWhitespace();
+    Value val;
+    val.type = Value::Array;
+    val.value.array = array;
 
-    if(!InterpretExpression(ctx))
+    ctx.push(val);
+
+    return true;
+}
+
+// Reads comma separated key and value pairs up to and including the closing brace. Keys are
+// integers or strings, and every value has the given type.
+static bool InterpretDictElements(Context &ctx, Value::Type element){
+    Dict *const dict = ctx.create<Dict>(Value::Dict, element);
+    if(!dict)
         return false;
 
-    array->push_back(ctx.pop());
-    const Value::Type must_be = array->back().type;
+    ctx.source().skipWhitespace();
 
-    while(ctx.source().peekc()==','){
-        ctx.source().skipWhitespace();
+    bool first = true;
+    while(ctx.source().peekc()!='}'){
+        if(!first){
+            if(!ctx.source().match(','))
+                return ctx.setError( Context::Error::SyntaxError, "Expected comma or end of dict literal after element" );
+            ctx.source().skipWhitespace();
+        }
+        first = false;
 
         if(!InterpretExpression(ctx))
             return false;
+        const Value key = ctx.pop();
+        if(key.type!=Value::Integer && key.type!=Value::String)
+            return ctx.setError( Context::Error::TypeError, std::string("Cannot use a ") + ValueName(key.type) + " as a dict key" );
 
-        if(must_be!=ctx.top().type)
-            return ctx.setError( Context::Error::TypeError, std::string("Invalid element of type ") + ValueName(ctx.top().type) + ", expected " + ValueName(must_be) );
+        ctx.source().skipWhitespace();
+        if(!InterpretExpression(ctx))
+            return false;
+        if(element!=ctx.top().type)
+            return ctx.setError( Context::Error::TypeError, std::string("Invalid element of type ") + ValueName(ctx.top().type) + ", expected " + ValueName(element) );
 
-        array->push_back(ctx.pop());
+        share(ctx.top());
+        dict->insert(key) = ctx.pop();
 
         ctx.source().skipWhitespace();
+        if(!ctx.source().valid())
+            return ctx.setError( Context::Error::SyntaxError, "Dict literal is never closed" );
     }
 
-    if(!ctx.source().match(']'))
-        return ctx.setError( Context::Error::SyntaxError, "Expected comma or close bracket after element of array" );
+    ctx.source().getc();
+    if(!ctx.update(dict, Value::Dict))
+        return false;
 
     Value val;
-    val.type = Value::Array;
-    val.value.array = array.release();
+    val.type = Value::Dict;
+    val.value.dict = dict;
 
     ctx.push(val);
 
     return true;
-
 }
 
-bool InterpretObjectLiteral(Context &ctx){
+  //  <arr_literal>    ::= '[' <type> [ <expression> ','z ]* ']'
+bool InterpretArrayLiteral(Context &ctx){
     ctx.source().skipWhitespace();
     if(!ctx.source().match('['))
         return ctx.setError( Context::Error::SyntaxError, "Expected array literal" );
 
-    std::unique_ptr<std::vector<Value>> array(new std::vector<Value>());
+    Value::Type element;
+    if(!ParseType(ctx.source(), element))
+        return ctx.setError( Context::Error::SyntaxError, "Expected element type at start of array literal" );
 
+    return InterpretArrayElements(ctx, element, ']');
+}
+
+  //  <obj_literal>    ::= ['clone' <identifier>] '{' (<type> <identifier> <expression> ','z )* '}'
+// When called for a clone, the 'clone' keyword has already been read. The new object starts
+// with a copy of every member of its prototype.
+bool InterpretObjectLiteral(Context &ctx){
     ctx.source().skipWhitespace();
 
-    if(!InterpretExpression(ctx))
+    std::map<std::string, Value> *const object = ctx.create<std::map<std::string, Value> >(Value::Object);
+    if(!object)
         return false;
 
-    array->push_back(ctx.pop());
-    const Value::Type must_be = array->back().type;
+    if(ctx.source().peekc()!='{'){
+        std::string prototype_name;
+        if(!ctx.source().getIdentifier(prototype_name))
+            return ctx.setError( Context::Error::SyntaxError, "Expected prototype name after clone" );
+
+        const Value prototype = ctx.findObject(prototype_name);
+        if(prototype.type!=Value::Object)
+            return ctx.setError( Context::Error::ReferenceError, std::string("Unknown prototype ") + prototype_name );
+
+        *object = *prototype.value.object;
+        for(const std::pair<const std::string, Value> &member : *object)
+            share(member.second);
+        if(!ctx.update(object, Value::Object))
+            return false;
+        ctx.source().skipWhitespace();
+    }
+
+    if(!ctx.source().match('{'))
+        return ctx.setError( Context::Error::SyntaxError, "Expected object literal" );
+
+    ctx.source().skipWhitespace();
+
+    bool first = true;
+    while(ctx.source().peekc()!='}'){
+        if(!first){
+            if(!ctx.source().match(','))
+                return ctx.setError( Context::Error::SyntaxError, "Expected comma or close brace after member of object" );
+            ctx.source().skipWhitespace();
+        }
+        first = false;
+
+        TypeSpecifier type;
+        if(!InterpretType(ctx, type))
+            return ctx.setError( Context::Error::SyntaxError, "Expected type specifier for object member" );
+
+        std::string name;
+        if(!ctx.source().getIdentifier(name))
+            return ctx.setError( Context::Error::SyntaxError, "Expected name of object member" );
 
-    while(ctx.source().peekc()==','){
         ctx.source().skipWhitespace();
 
         if(!InterpretExpression(ctx))
             return false;
 
-        if(must_be!=ctx.top().type)
-            return ctx.setError( Context::Error::TypeError, std::string("Invalid element of type ") + ValueName(ctx.top().type) + ", expected " + ValueName(must_be) );
+        if(type.our_type!=ctx.top().type)
+            return ctx.setError( Context::Error::TypeError, name + " is of type " + ValueName(type.our_type) + " but is initialized with value of type " + ValueName(ctx.top().type) );
 
-        array->push_back(ctx.pop());
+        share(ctx.top());
+        (*object)[name] = ctx.pop();
 
         ctx.source().skipWhitespace();
     }
 
-    if(!ctx.source().match(']'))
-        return ctx.setError( Context::Error::SyntaxError, "Expected comma or close bracket after element of array" );
+    ctx.source().getc();
+    if(!ctx.update(object, Value::Object))
+        return false;
 
     Value val;
-    val.type = Value::Array;
-    val.value.array = array.release();
+    val.type = Value::Object;
+    val.value.object = object;
 
     ctx.push(val);
 
     return true;
-
 }
 
 bool InterpretVariableDeclaration(Context &ctx){
@@ -761,7 +1168,19 @@ bool InterpretVariableDeclaration(Context &ctx){
 
     ctx.source().skipWhitespace();
 
-    if(!InterpretExpression(ctx))
+    // Arrays can be initialized with bare elements, as in array int foo { 1, 2, 3 }
+    if(type.our_type==Value::Array && ctx.source().peekc()=='{'){
+        ctx.source().getc();
+        if(!InterpretArrayElements(ctx, type.return_type, '}'))
+            return false;
+    }
+    // Dicts likewise with key and value pairs, as in dict int foo { "a" 1, 2 3 }
+    else if(type.our_type==Value::Dict && ctx.source().peekc()=='{'){
+        ctx.source().getc();
+        if(!InterpretDictElements(ctx, type.return_type))
+            return false;
+    }
+    else if(!InterpretExpression(ctx))
         return false;
 
     Value that = ctx.pop();
@@ -769,61 +1188,105 @@ bool InterpretVariableDeclaration(Context &ctx){
     if(that.type!=type.our_type)
         return ctx.setError( Context::Error::TypeError, name + " is of type " + ValueName(type.our_type) + " but is initialized with value of type " + ValueName(that.type) );
 
+    if(that.type==Value::Array && !that.value.array->empty() && that.value.array->front().type!=type.return_type)
+        return ctx.setError( Context::Error::TypeError, name + " is an Array of " + ValueName(type.return_type) + " but is initialized with an Array of " + ValueName(that.value.array->front().type) );
+    if(that.type==Value::Dict && that.value.dict->element()!=type.return_type)
+        return ctx.setError( Context::Error::TypeError, name + " is a Dict of " + ValueName(type.return_type) + " but is initialized with a Dict of " + ValueName(that.value.dict->element()) );
+
     ctx.addVariable(name, that);
     return true;
 
 }
 
+  //  <function_decl>  ::= 'function' <type> <identifier> '(' (<type> <identifier>','z )* ')' <scope>
+// Declarations are parsed once when the Program is compiled, so this only binds the name.
 bool InterpretFunctionDeclaration(Context &ctx){
-    ctx.source().skipWhitespace();
+    const Function *func = ctx.program().functionDeclaredAt(ctx.source().position());
+    if(!func)
+        return ctx.setError( Context::Error::SyntaxError, "Expected function declaration" );
+
+    // Top-level functions are already visible through the program's function table.
+    if(ctx.program().findFunction(func->name)!=func){
+        Value val; val.type = Value::Function; val.value.function = func;
+        ctx.addVariable(func->name, val);
+    }
 
-    std::string func_name;
-    ctx.source().getIdentifier(func_name);
+    ctx.source().position(func->start);
+    skip_scope(ctx);
 
-    ctx.source().skipWhitespace();
+    if(!ctx.source().match('.'))
+        return ctx.setError( Context::Error::SyntaxError, std::string("Expected end of scope after function ") + func->name );
 
-    if(!ctx.source().match('('))
-        return ctx.setError( Context::Error::SyntaxError, "Expected start of argument list in function declaration" );
+    return true;
+}
 
-    Function func;
-    
+const char *ParseFunctionDeclaration(Source &src, Function &func){
+    src.skipWhitespace();
 
-    do{
-        ctx.source().skipWhitespace();
+    TypeSpecifier return_type;
+    if(!ParseType(src, return_type))
+        return "Expected return type in function declaration";
+    func.return_type = return_type.our_type;
+
+    src.skipWhitespace();
+
+    func.name.clear();
+    if(!src.getIdentifier(func.name))
+        return "Expected function name";
+
+    src.skipWhitespace();
+
+    if(!src.match('('))
+        return "Expected start of argument list in function declaration";
+
+    src.skipWhitespace();
+
+    func.args.clear();
+    while(src.peekc()!=')'){
+        src.skipWhitespace();
 
         TypeSpecifier type;
-        if(!InterpretType(ctx, type))
-            return ctx.setError( Context::Error::SyntaxError, "Expected type specifier" );
+        if(!ParseType(src, type))
+            return "Expected type specifier";
 
         std::string name;
-        if(!ctx.source().getIdentifier(name))
-            return ctx.setError( Context::Error::SyntaxError, "Expected argument name" );
+        if(!src.getIdentifier(name))
+            return "Expected argument name";
 
         func.args.push_back({name, type});
 
-        ctx.source().skipWhitespace();
+        src.skipWhitespace();
 
-    }while(ctx.source().peekc()==',');
+        if(src.peekc()==',')
+            src.getc();
+        else
+            break;
+    }
 
-    if(!ctx.source().match(')'))
-        return ctx.setError( Context::Error::SyntaxError, "Expected close paren at end of argument list");
+    if(!src.match(')'))
+        return "Expected close paren at end of argument list";
 
-    ctx.source().skipWhitespace();
-    if(ctx.source().peekc()!=':')
-        return ctx.setError( Context::Error::SyntaxError, "Expected colon at start of function");
+    src.skipWhitespace();
+    if(src.peekc()!=':')
+        return "Expected colon at start of function";
 
-    func.start = ctx.source().position();
+    func.start = src.position();
+    return nullptr;
+}
 
-    skip_scope(ctx);
+bool InterpretType(Context &ctx, Value::Type &type){
+    return ParseType(ctx.source(), type);
+}
 
-    return true;
+bool InterpretType(Context &ctx, TypeSpecifier &type){
+    return ParseType(ctx.source(), type);
 }
 
-bool InterpretType(Context &ctx, Value::Type &type){
-    ctx.source().skipWhitespace();
+bool ParseType(Source &src, Value::Type &type){
+    src.skipWhitespace();
 
     std::string type_str;
-    ctx.source().getAlphaIdentifier(type_str);
+    src.getAlphaIdentifier(type_str);
 
     if(type_str==int_keyword)
         type = Value::Integer;
@@ -835,7 +1298,9 @@ bool InterpretType(Context &ctx, Value::Type &type){
         type = Value::Boolean;
     else if(type_str==array_keyword)
         type = Value::Array;
-    else if(type_str==prototype_keyword)
+    else if(type_str==dict_keyword)
+        type = Value::Dict;
+    else if(type_str==prototype_keyword || type_str==object_keyword)
         type = Value::Object;
     else if(type_str==function_keyword)
         type = Value::Function;
@@ -846,12 +1311,15 @@ bool InterpretType(Context &ctx, Value::Type &type){
 
 }
 
-bool InterpretType(Context &ctx, TypeSpecifier &type){
+bool ParseType(Source &src, TypeSpecifier &type){
+    src.skipWhitespace();
+    Source keyword = src;
+
     Value::Type l_type;
-    if(!InterpretType(ctx, l_type))
+    if(!ParseType(src, l_type))
         return false;
 
-    ctx.source().skipWhitespace();
+    src.skipWhitespace();
 
     type.our_type = l_type;
     type.return_type = Value::Null;
@@ -863,13 +1331,18 @@ bool InterpretType(Context &ctx, TypeSpecifier &type){
             return false;
         case Value::Integer: case Value::Floating: case Value::String: case Value::Boolean:
             return true;
-        case Value::Array:
-            if(!InterpretType(ctx, l_type))
+        case Value::Array: case Value::Dict:
+            if(!ParseType(src, l_type))
                 return false;
             type.return_type = l_type;
             return true;
         case Value::Object:
-            return ctx.source().getIdentifier(type.prototype);
+            {
+                // 'object' has no prototype, 'prototype <identifier>' names one.
+                std::string word;
+                keyword.getAlphaIdentifier(word);
+                return word==object_keyword || src.getIdentifier(type.prototype);
+            }
         case Value::Function:
             // TODO: actually parse functions.
             return false;
@@ -884,8 +1357,8 @@ bool InterpretScope(Context &ctx){
     if(!InterpretProgram(ctx))
         return false;
 
-    if(ctx.source().peekc()!=':')
-        return ctx.setError(Context::Error::SyntaxError, "Expected colon at start of scope");
+    if(!ctx.unwinding && ctx.source().peekc()!='.')
+        return ctx.setError(Context::Error::SyntaxError, "Expected dot at end of scope");
     return true;
 }
 
@@ -9,14 +9,16 @@ namespace Lithium{
     This reference will also apply to interpreter, since our bytecode is mostly just token code.
 
     <program>        ::= [<statement> '\n']*
-    <statement>      ::= <set> | <call> | <variable_decl> | <function_decl> | <if> | <loop> | <return> | <up>
+    <statement>      ::= <set> | <call> | <variable_decl> | <function_decl> | <if> | <loop> | <for> | <return> | <up>
     <scope>          ::= ':' [<statement> '\n']* '.'
     <set>            ::= 'set' <identifier> <expression> // NOTE <identifier> should really be the same as 'get' minus the keyword.
     <call>           ::= 'call' <expression> '(' (<expression>, )* ')'
 
     <if>             ::= 'if' <expression> <scope>
     <loop>           ::= 'loop' <expression> <scope>
+    <for>            ::= 'for' <type> <identifier> <expression> [',' <expression>] <scope>
     <return>         ::= 'return' <expression>
+    <up>             ::= 'up'
 
     <expression>     ::= <term> [<addop> <term>]*
     <term>           ::= <factor> [<mulop> <factor>]*
@@ -42,9 +44,12 @@ bool InterpretStatement(Context &ctx);
 
 bool InterpretSet(Context &ctx);
 bool InterpretCall(Context &ctx);
+// Runs function with args, which must match its argument types, and leaves the result on the stack.
+bool InterpretFunction(Context &ctx, const Function &function, const Value *args);
 
 bool InterpretIf(Context &ctx);
 bool InterpretLoop(Context &ctx);
+bool InterpretFor(Context &ctx);
 bool InterpretReturn(Context &ctx);
 bool InterpretUp(Context &ctx);
 
@@ -65,9 +70,44 @@ bool InterpretFunctionDeclaration(Context &ctx);
 // Helpers...
 bool InterpretType(Context &ctx, Value::Type &type);
 bool InterpretType(Context &ctx, TypeSpecifier &type);
+bool ParseType(Source &src, Value::Type &type);
+bool ParseType(Source &src, TypeSpecifier &type);
+// Parses a function declaration after the 'function' keyword, stopping on the ':' of its body.
+// Returns nullptr on success, or a description of the syntax error.
+const char *ParseFunctionDeclaration(Source &src, Function &func);
 bool InterpretScope(Context &ctx);
 bool GetConditional(Context &ctx);
 bool ConditionalType(Context &ctx);
 bool ConditionalSuccess(Value val);
 
+// The bitwise operators, which are told apart by the two characters at the start of one. The
+// shifts and rotations are two characters long, and the rest one.
+enum e_bitop { z, shr, shl, ror, rol, bor, band, bxor };
+
+inline bool is_double_char_bitop(e_bitop b){
+    return b==shr || b==shl || b==ror || b==rol;
+}
+
+inline e_bitop is_bitop(char c1, char c2){
+    if(c1!=c2){
+        if(c1=='|' && c2=='>')
+            return ror;
+        if(c1=='<' && c2=='|')
+            return rol;
+        if(c1=='|')
+            return bor;
+        if(c1=='&')
+            return band;
+        if(c1=='^')
+            return bxor;
+    }
+    else{
+        if(c1=='>')
+            return shr;
+        if(c1=='<')
+            return shl;
+    }
+    return z;
+}
+
 } // namespace Lithium
@@ -0,0 +1,34 @@
+#include "metrics.hpp"
+#include <cstring>
+#include <string>
+
+namespace Lithium{
+
+#ifdef LITHIUM_METRICS
+const bool Metrics::enabled = true;
+#else
+const bool Metrics::enabled = false;
+#endif
+
+Metrics::Metrics(){
+    memset(this, 0, sizeof(Metrics));
+}
+
+void Metrics::writeJSON(FILE *out) const{
+    fprintf(out, "{\n  \"enabled\": %s,\n", enabled ? "true" : "false");
+    fprintf(out, "  \"statements\": %llu,\n", (unsigned long long)statements);
+    fprintf(out, "  \"calls\": %llu,\n", (unsigned long long)calls);
+    fprintf(out, "  \"lookups\": %llu,\n", (unsigned long long)lookups);
+    fprintf(out, "  \"scopes_walked\": %llu,\n", (unsigned long long)scopes_walked);
+    fprintf(out, "  \"stack_high_water\": %llu,\n", (unsigned long long)stack_high_water);
+    fputs("  \"allocations\": {", out);
+    for(unsigned i = 0; i<=Value::Dict; i++){
+        fprintf(out, "%s\"%s\": %llu", i ? ", " : " ", ValueName((Value::Type)i).c_str(), (unsigned long long)allocations[i]);
+    }
+    fputs(" },\n", out);
+    fprintf(out, "  \"bytes_live\": %llu,\n", (unsigned long long)bytes_live);
+    fprintf(out, "  \"bytes_peak\": %llu,\n", (unsigned long long)bytes_peak);
+    fprintf(out, "  \"frame_frees\": %llu\n}\n", (unsigned long long)frame_frees);
+}
+
+} // namespace Lithium
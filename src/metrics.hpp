@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include "variables.hpp"
+
+// Building with LITHIUM_METRICS defined turns on the per-Context counters. Without it, every
+// LITHIUM_METRIC statement compiles to nothing, and the counters all read as zero.
+#ifdef LITHIUM_METRICS
+#define LITHIUM_METRIC(X) do{ X; }while(0)
+#else
+#define LITHIUM_METRIC(X) do{}while(0)
+#endif
+
+namespace Lithium{
+
+struct Metrics{
+    static const bool enabled;
+
+    uint64_t statements, calls;
+    // Every variable lookup, and the number of scopes each one had to search.
+    uint64_t lookups, scopes_walked;
+    uint64_t stack_high_water;
+    // Indexed by Value::Type.
+    uint64_t allocations[Value::Dict+1];
+    uint64_t bytes_live, bytes_peak;
+    // Allocations freed by contained functions as they returned.
+    uint64_t frame_frees;
+
+    Metrics();
+
+    void writeJSON(FILE *out) const;
+};
+
+} // namespace Lithium
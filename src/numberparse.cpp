@@ -22,41 +22,48 @@ static uint_fast8_t hex_from_digit(char c){
         return 0;
 }
 
-struct l_complex { int64_t n; uint64_t d; };
+struct l_complex { int64_t n; uint64_t d; uint_fast16_t digits; bool negative; };
+
+// Reads characters from memory the way that Source reads them from a script.
+struct CharRange{
+    const char *at, *end;
+
+    inline char getc(){ return at==end ? 0 : *at++; }
+    inline char peekc() const { return at==end ? 0 : *at; }
+    inline char peekc(uint64_t ahead) const { return uint64_t(end - at) > ahead ? at[ahead] : 0; }
+};
 
 // Returns {x, y} where val = "$x.$y"
-static l_complex number_literal(Source &src){
-    l_complex that = { 0ll, 0llu };
-    bool negative = false;
+template<class Reader>
+static l_complex number_literal(Reader &src){
+    l_complex that = { 0ll, 0llu, 0u, false };
     if(src.peekc()=='-'){
-        negative = true;
+        that.negative = true;
         src.getc();
     }
 
     const char c1 = src.getc();
-    if(c1=='0'){
-        const char c2 = src.getc();
-        if(c2=='x' || c2=='X'){
-            char c3;
-            while(Source::isHexNum(c3 = src.peekc())){
-                that.n<<=4;
-                that.n += hex_from_digit(c3);
-                src.getc();
-            }
+    const char c2 = src.peekc();
+    if(c1=='0' && (c2=='x' || c2=='X')){
+        src.getc();
+        char c3;
+        while(Source::isHexNum(c3 = src.peekc())){
+            that.n<<=4;
+            that.n += hex_from_digit(c3);
+            src.getc();
         }
-        else{
-            char c3;
-            that.n = c2 - '0';
-            while(Source::isHexNum(c3 = src.peekc())){
-                that.n<<=3;
-                that.n += c3 - '0';
-                src.getc();
-            }
+    }
+    else if(c1=='0' && is_oct(c2)){
+        char c3;
+        while(is_oct(c3 = src.peekc())){
+            that.n<<=3;
+            that.n += c3 - '0';
+            src.getc();
         }
     }
     // Skip a check for is_numeric(c1). Garbage in, garbage out.
     else{
-        that.n = c1;
+        that.n = c1 - '0';
         char c3;
         while(Source::isNum(c3 = src.peekc())){
             that.n *= 10;
@@ -64,47 +71,45 @@ static l_complex number_literal(Source &src){
             src.getc();
         }
 
-        if(c3=='.'){
+        // A '.' that is not followed by a digit ends a scope.
+        if(c3=='.' && Source::isNum(src.peekc(1))){
             src.getc();
             while(Source::isNum(c3 = src.peekc())){
                 that.d *= 10;
                 that.d += c3 - '0';
+                that.digits++;
                 src.getc();
             }
         }
     }
-    if(negative)
+    if(that.negative)
         that.n= -that.n;
     return that;
 }
 
-static double rasterize_complex(int64_t a, uint64_t b){
+static double rasterize_complex(int64_t a, uint64_t b, uint_fast16_t digits){
     if(b==0){
         return a;
     }
     else{
-        // log10 is way slower than this. Probably something to do with standards.
-        uint_fast16_t digits = 0;
-        uint64_t z = b;
-        assert(z);
-        while(z){
-            digits++;
-            z/=10;
-        }
-        double dec = (double)b / ((double)digits*10.0);
+        // pow is way slower than this. Probably something to do with standards.
+        double scale = 1.0;
+        while(digits--)
+            scale*=10.0;
+        double dec = (double)b / scale;
         return dec + (double)a;
     }
 }
 
 static double rasterize_complex(const l_complex &that){
-    return rasterize_complex(that.n, that.d);
+    // The fraction has the sign of the whole number, which is lost when that is -0.
+    if(that.negative)
+        return -rasterize_complex(-that.n, that.d, that.digits);
+    return rasterize_complex(that.n, that.d, that.digits);
 }
 
-bool ParseNumberLiteral(Context &ctx, Value &to){
-    if(!Source::isNum(ctx.source().peekc()))
-        return false;
-    l_complex that = number_literal(ctx.source());
-    if(that.d==0llu){
+static void to_value(const l_complex &that, Value &to){
+    if(that.digits==0u){
         to.type = Value::Integer;
         to.value.integer = that.n;
     }
@@ -112,6 +117,21 @@ bool ParseNumberLiteral(Context &ctx, Value &to){
         to.type = Value::Floating;
         to.value.floating = rasterize_complex(that);
     }
+}
+
+bool ParseNumberLiteral(Context &ctx, Value &to){
+    if(!Source::isNum(ctx.source().peekc()))
+        return false;
+    to_value(number_literal(ctx.source()), to);
+    return true;
+}
+
+bool ParseNumber(const char *&at, const char *end, Value &to){
+    CharRange src = { at, end };
+    if(!Source::isNum(src.peekc()) && !(src.peekc()=='-' && Source::isNum(src.peekc(1))))
+        return false;
+    to_value(number_literal(src), to);
+    at = src.at;
     return true;
 }
 
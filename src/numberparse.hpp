@@ -4,5 +4,8 @@
 namespace Lithium {
 
 bool ParseNumberLiteral(Context &ctx, Value &to);
+// Parses a number at the start of [at, end) as a literal is parsed, except that it can have a
+// leading '-'. On success, at is moved past it.
+bool ParseNumber(const char *&at, const char *end, Value &to);
 
 } // namespace Lithium
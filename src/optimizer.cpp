@@ -0,0 +1,983 @@
+#include "program.hpp"
+#include "context.hpp"
+#include "interpreter.hpp"
+#include "numberparse.hpp"
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <set>
+
+// The interpreter runs the source itself, so the optimizer rewrites the source. It reads
+// expressions and statements the way the interpreter does, and only rewrites what it fully
+// understands. Anything else is left as it is, to run, or fail, exactly as it would have.
+//
+// Every rewrite replaces text with text of the same length, padded with spaces, and keeps every
+// newline. The offsets of everything that is left, and so line numbers in errors and profiles,
+// are those of the source as written.
+
+namespace Lithium{
+
+static const std::string get_keyword("get"),
+    set_keyword("set"),
+    call_keyword("call"),
+    clone_keyword("clone"),
+    function_keyword("function"),
+    for_keyword("for"),
+    if_keyword("if"),
+    return_keyword("return");
+
+namespace{
+
+// Each pass can uncover more for the next, as when a propagated constant is the condition of an
+// if statement. Few programs need more than two.
+const int max_passes = 8;
+
+const uint64_t no_function = ~0llu;
+
+inline bool isOperator(char c){
+    return c=='+' || c=='-' || c=='*' || c=='/' || c=='|' || c=='&' || c=='^' || c=='<' || c=='>';
+}
+
+inline bool isBlank(char c){
+    return c==' ' || c=='\t' || c=='\r' || c=='\v';
+}
+
+// Whether a word starts a value that is not a literal.
+inline bool isValueKeyword(const std::string &word){
+    return word==get_keyword || word==call_keyword || word==clone_keyword;
+}
+
+bool Overflows(char op, int64_t a, int64_t b){
+    switch(op){
+        case '+':
+            return b>0 ? a>INT64_MAX-b : a<INT64_MIN-b;
+        case '-':
+            return b<0 ? a>INT64_MAX+b : a<INT64_MIN+b;
+        case '*':
+            if(a==0 || b==0)
+                return false;
+            if(a==-1)
+                return b==INT64_MIN;
+            if(b==-1)
+                return a==INT64_MIN;
+            return int64_t(uint64_t(a) * uint64_t(b)) / b != a;
+        case '/':
+            return b==0 || (a==INT64_MIN && b==-1);
+    }
+    return true;
+}
+
+// Applies an operator of InterpretExpression or InterpretTerm the way they do. Returns false
+// where they would fail, and where integer arithmetic would overflow or divide by zero, which
+// is left to happen at run time rather than here.
+bool Arithmetic(char op, Value &first, Value second){
+    const Value::Type type = MutualCast(first, second);
+    if(!TypeIsArithmetic(type))
+        return false;
+    MutualCastValue(first, second, type);
+    if(type==Value::Integer && Overflows(op, first.value.integer, second.value.integer))
+        return false;
+
+    switch(op){
+        case '+':
+            ValueBinaryOpIntegerOrFloating<std::plus>(first, second);
+            return true;
+        case '-':
+            ValueBinaryOpIntegerOrFloating<std::minus>(first, second);
+            return true;
+        case '*':
+            ValueBinaryOpIntegerOrFloating<std::multiplies>(first, second);
+            return true;
+        case '/':
+            ValueBinaryOpIntegerOrFloating<std::divides>(first, second);
+            return true;
+    }
+    return false;
+}
+
+// The type that an operator gives its operands, or Null if either is not known or the operator
+// fails on them. Bitwise operators are passed as 0.
+Value::Type ResultType(char op, Value::Type first, Value::Type second){
+    if(op=='+' && first==Value::String && second==Value::String)
+        return Value::String;
+    const Value::Type type = MutualCast(first, second);
+    return TypeIsArithmetic(type) ? type : Value::Null;
+}
+
+// Applies an operator of InterpretFactor the way it does, shifts of negative numbers and by
+// amounts out of range aside.
+bool Bitwise(e_bitop op, Value &first, Value second){
+    const Value::Type type = MutualCast(first, second);
+    if(!TypeIsArithmetic(type))
+        return false;
+    MutualCastValue(first, second, type);
+
+    if(type==Value::Integer){
+        const int64_t a = first.value.integer, b = second.value.integer;
+        if((op==shl || op==rol) && a<0)
+            return false;
+        if((op==shl || op==shr) && (b<0 || b>=64))
+            return false;
+        if((op==rol || op==ror) && (b<0 || b>int64_t(sizeof(int64_t))))
+            return false;
+    }
+
+    switch(op){
+        case band:
+            ValueBinaryOpInteger<std::bit_and>(first, second);
+            return true;
+        case bor:
+            ValueBinaryOpInteger<std::bit_or>(first, second);
+            return true;
+        case bxor:
+            ValueBinaryOpInteger<std::bit_xor>(first, second);
+            return true;
+        case shr:
+            ValueBinaryOpInteger<arith::bitshiftright>(first, second);
+            return true;
+        case shl:
+            ValueBinaryOpInteger<arith::bitshiftleft>(first, second);
+            return true;
+        case ror:
+            ValueBinaryOpInteger<arith::bitrotateright>(first, second);
+            return true;
+        case rol:
+            ValueBinaryOpInteger<arith::bitrotateleft>(first, second);
+            return true;
+        case z:
+            return false;
+    }
+    return false;
+}
+
+// Writes val as a literal that reads back as exactly val. There are no negative literals, and
+// floats are only written without an exponent, so not every value has one.
+bool Literal(const Value &val, std::string &text){
+    switch(val.type){
+        case Value::Boolean:
+            text = val.value.boolean ? "`" : "~";
+            return true;
+        case Value::Integer:
+            if(val.value.integer<0)
+                return false;
+            text = std::to_string(val.value.integer);
+            return true;
+        case Value::Floating:{
+            const float f = val.value.floating;
+            if(!(f>=0.0f && f<1e15f) || std::signbit(f))
+                return false;
+            char digits[32];
+            for(int precision = 1; precision<=9; precision++){
+                const int length = snprintf(digits, sizeof(digits), "%.*f", precision, f);
+                const char *at = digits;
+                Value back;
+                if(ParseNumber(at, digits + length, back) && at==digits + length &&
+                    back.type==Value::Floating && back.value.floating==f){
+                    text.assign(digits, length);
+                    return true;
+                }
+            }
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+
+// Every variable, argument and function of a program by name, and which of them are ever set.
+struct Names{
+    std::map<std::string, uint64_t> bindings;
+    // The type that every binding of a name has, or Null where they differ.
+    std::map<std::string, Value::Type> types;
+    std::set<std::string> assigned;
+
+    void bind(const std::string &name, Value::Type type){
+        const std::map<std::string, Value::Type>::iterator i = types.find(name);
+        if(i==types.end())
+            types[name] = type;
+        else if(i->second!=type)
+            i->second = Value::Null;
+        bindings[name]++;
+    }
+};
+
+class Optimizer{
+    const Program &program_;
+    std::string &src_;
+    bool changed_;
+    // The '(' of every argument list found so far, which must not be read as a nested expression.
+    std::set<uint64_t> arguments_;
+
+    // What is known of a value or expression. A compound one is worth folding into a literal.
+    // type is Null where the type it has when run is not known. A pure one only reads
+    // variables, and a simple one is a single literal, string or get of a variable.
+    struct Operand{
+        bool known, compound, pure, simple;
+        Value value;
+        Value::Type type;
+    };
+
+    // What gather finds.
+    struct Constant { uint64_t after, end, owner; std::string text; };
+    struct Get { uint64_t start, end, owner; };
+    Names names_;
+    std::map<std::string, Constant> constants_;
+    std::map<std::string, std::vector<Get> > gets_;
+    // The functions declared outside of any scope, and the 'call' of each call in an expression.
+    std::map<std::string, Function> functions_;
+    std::vector<uint64_t> calls_;
+
+    // The arguments of the function whose body is being read, if any.
+    const std::vector<std::pair<std::string, TypeSpecifier> > *params_;
+    // What has been inlined so far, which the string and scope tables no longer describe.
+    std::vector<std::pair<uint64_t, uint64_t> > inlined_;
+
+    // The arguments of a call that is being inlined.
+    struct Arguments{
+        const Function &func;
+        std::vector<Operand> operands;
+        std::vector<std::string> texts;
+        std::vector<uint64_t> uses;
+    };
+
+    inline uint64_t offset(std::string::const_iterator i) const { return program_.offset(i); }
+    inline std::string::const_iterator at(uint64_t offset) const { return program_.source().cbegin() + offset; }
+
+    // Replaces [start, end) with text followed by spaces. Returns false if text does not fit, or
+    // would run into what is around it.
+    bool replace(uint64_t start, uint64_t end, const std::string &text){
+        const uint64_t length = end - start;
+        if(text.length() > length || text.empty())
+            return false;
+        if(start && (Source::isIdent(src_[start-1]) || src_[start-1]=='.') && Source::isIdent(text[0]))
+            return false;
+        if(text.length()==length && end<src_.length() && (Source::isIdent(src_[end]) || src_[end]=='.'))
+            return false;
+
+        std::string padded(text);
+        padded.resize(length, ' ');
+        if(src_.compare(start, length, padded)!=0){
+            std::copy(padded.cbegin(), padded.cend(), src_.begin() + start);
+            changed_ = true;
+        }
+        return true;
+    }
+
+    // Replaces everything in [start, end) but newlines with spaces.
+    void blank(uint64_t start, uint64_t end){
+        for(uint64_t i = start; i<end; i++){
+            if(src_[i]!='\n' && src_[i]!=' '){
+                src_[i] = ' ';
+                changed_ = true;
+            }
+        }
+    }
+
+    void fold(uint64_t start, uint64_t end, const Operand &operand){
+        std::string text;
+        if(operand.known && operand.compound && Literal(operand.value, text))
+            replace(start, end, text);
+    }
+
+    // Combines the operand so far, which ends at end, with the next one. Once either is not
+    // known, neither is the result, and the operand so far is folded where it stands.
+    template<typename Apply>
+    void combine(uint64_t start, uint64_t end, Operand &result, const Operand &next, Value::Type type, Apply apply){
+        result.type = type;
+        result.pure = result.pure && next.pure;
+        result.simple = false;
+        if(result.known && next.known){
+            Value value = result.value;
+            if(apply(value, next.value)){
+                result.value = value;
+                result.compound = true;
+                return;
+            }
+        }
+        fold(start, end, result);
+        result.known = false;
+    }
+
+    bool skipString(Source &src) const{
+        const Program::StringConstant *constant = program_.stringConstant(src.position());
+        if(!constant)
+            return false;
+        src.position(at(constant->end));
+        return true;
+    }
+
+    // Skips an array, object or dict literal, or an argument list, which cannot span lines.
+    bool skipBalanced(Source &src) const{
+        uint64_t depth = 0llu;
+        while(src.valid()){
+            const char c = src.peekc();
+            if(c=='"'){
+                if(!skipString(src))
+                    return false;
+                continue;
+            }
+            if(c=='\n' || c=='%' || c==':')
+                return false;
+            src.getc();
+            if(c=='(' || c=='[' || c=='{')
+                depth++;
+            else if((c==')' || c==']' || c=='}') && --depth==0llu)
+                return true;
+        }
+        return false;
+    }
+
+    // Reads a number or boolean literal.
+    bool literal(Source &src, Value &val) const{
+        const char c = src.peekc();
+        if(c=='`' || c=='~'){
+            src.getc();
+            val.type = Value::Boolean;
+            val.value.boolean = c=='`';
+            return true;
+        }
+        if(!Source::isNum(c))
+            return false;
+
+        const char *const data = src_.data();
+        const char *end = data + src.offset();
+        if(!ParseNumber(end, data + src_.length(), val))
+            return false;
+        src.position(at(end - data));
+        return true;
+    }
+
+    // The type of what get name finds, if it is a variable.
+    Value::Type typeOf(const std::string &name) const{
+        if(params_){
+            for(const std::pair<std::string, TypeSpecifier> &param : *params_){
+                if(param.first==name)
+                    return param.second.our_type;
+            }
+        }
+        const std::map<std::string, Value::Type>::const_iterator i = names_.types.find(name);
+        return i==names_.types.end() ? Value::Null : i->second;
+    }
+
+    // The function that get name always finds, if there is one.
+    const Function *staticFunction(const std::string &name) const{
+        const std::map<std::string, Function>::const_iterator i = functions_.find(name);
+        if(i==functions_.end() || names_.assigned.count(name) || names_.bindings.find(name)->second!=1llu)
+            return nullptr;
+        return &i->second;
+    }
+
+    // Reads the '[' <type> <index> ']' after a get of a variable of type container. Only arrays
+    // and dicts check that what is fetched has the type asked for.
+    bool element(Source &src, Value::Type container, Operand &result){
+        result.type = Value::Null;
+        result.pure = result.simple = false;
+
+        Source index = src;
+        index.getc();
+        TypeSpecifier type;
+        if(ParseType(index, type)){
+            index.skipWhitespace();
+            // Object members can be named directly.
+            Source member = index;
+            std::string word;
+            Operand key;
+            key.pure = true;
+            bool read = true;
+            if(Source::isAlpha(index.peekc()) && member.getIdentifier(word) && !isValueKeyword(word))
+                index = member;
+            else
+                read = expression(index, key);
+            if(read && index.skipWhitespace() && index.match(']')){
+                src = index;
+                result.pure = key.pure;
+                if(container==Value::Array || container==Value::Dict)
+                    result.type = type.our_type;
+                return true;
+            }
+        }
+        return skipBalanced(src);
+    }
+
+    // These follow InterpretValue, InterpretFactor, InterpretTerm and InterpretExpression, and
+    // return false for anything that they cannot read. Each folds what it reads if it is known.
+    bool value(Source &src, Operand &result){
+        src.skipWhitespace();
+        result.known = result.compound = false;
+        result.pure = result.simple = true;
+        result.value.type = result.type = Value::Null;
+
+        const char c = src.peekc();
+        if(Source::isNum(c) || c=='`' || c=='~'){
+            result.known = literal(src, result.value);
+            result.type = result.value.type;
+            return result.known;
+        }
+        else if(c=='('){
+            src.getc();
+            if(!expression(src, result))
+                return false;
+            src.skipWhitespace();
+            result.compound = true;
+            result.simple = false;
+            return src.match(')');
+        }
+        else if(c=='"'){
+            result.type = Value::String;
+            return skipString(src);
+        }
+        else if(c=='[' || c=='{'){
+            result.type = c=='[' ? Value::Array : Value::Object;
+            result.pure = result.simple = false;
+            return skipBalanced(src);
+        }
+
+        std::string word;
+        if(!src.getAlphaIdentifier(word))
+            return false;
+
+        if(word==get_keyword){
+            std::string name;
+            if(!src.getIdentifier(name))
+                return false;
+            result.type = typeOf(name);
+            Source index = src;
+            index.skipWhitespace();
+            if(index.peekc()!='[')
+                return true;
+            src = index;
+            return element(src, result.type, result);
+        }
+        else if(word==call_keyword){
+            Source named = src;
+            std::string keyword, name;
+            const bool callee_named = named.getAlphaIdentifier(keyword) && keyword==get_keyword && named.getIdentifier(name);
+
+            Operand callee;
+            if(!expression(src, callee))
+                return false;
+            src.skipWhitespace();
+            if(src.peekc()!='(')
+                return false;
+            if(callee_named && callee.simple){
+                if(const Function *const func = staticFunction(name))
+                    result.type = func->return_type;
+            }
+            result.pure = result.simple = false;
+            arguments_.insert(src.offset());
+            return skipBalanced(src);
+        }
+        else if(word==clone_keyword){
+            result.type = Value::Object;
+            result.pure = result.simple = false;
+            std::string prototype;
+            if(!src.getIdentifier(prototype))
+                return false;
+            src.skipWhitespace();
+            return src.peekc()=='{' && skipBalanced(src);
+        }
+        return false;
+    }
+
+    bool factor(Source &src, Operand &result){
+        src.skipWhitespace();
+        const uint64_t start = src.offset();
+        if(!value(src, result))
+            return false;
+
+        uint64_t end = src.offset();
+        while(src.skipWhitespace()){
+            const e_bitop op = is_bitop(src.peekc(), src.peekc(1));
+            if(!op)
+                break;
+            src.getc();
+            if(is_double_char_bitop(op))
+                src.getc();
+
+            Operand next;
+            if(!value(src, next))
+                return false;
+            combine(start, end, result, next, ResultType(0, result.type, next.type),
+                [op](Value &a, const Value &b){ return Bitwise(op, a, b); });
+            end = src.offset();
+        }
+        fold(start, end, result);
+        return true;
+    }
+
+    bool term(Source &src, Operand &result){
+        src.skipWhitespace();
+        const uint64_t start = src.offset();
+        if(!factor(src, result))
+            return false;
+
+        uint64_t end = src.offset();
+        while(src.skipWhitespace()){
+            const char op = src.peekc();
+            if(op!='*' && op!='/')
+                break;
+            src.getc();
+
+            Operand next;
+            if(!factor(src, next))
+                return false;
+            combine(start, end, result, next, ResultType(op, result.type, next.type),
+                [op](Value &a, const Value &b){ return Arithmetic(op, a, b); });
+            end = src.offset();
+        }
+        fold(start, end, result);
+        return true;
+    }
+
+    bool expression(Source &src, Operand &result){
+        src.skipWhitespace();
+        const uint64_t start = src.offset();
+        if(!term(src, result))
+            return false;
+
+        uint64_t end = src.offset();
+        while(src.skipWhitespace()){
+            const char op = src.peekc();
+            if(op!='+' && op!='-')
+                break;
+            src.getc();
+
+            Operand next;
+            if(!term(src, next))
+                return false;
+            combine(start, end, result, next, ResultType(op, result.type, next.type),
+                [op](Value &a, const Value &b){ return Arithmetic(op, a, b); });
+            end = src.offset();
+        }
+        fold(start, end, result);
+        return true;
+    }
+
+    // Whether an expression starts at src, given the character before it and the last one that
+    // is not blank. A value that follows an operator is part of an expression that starts
+    // further back.
+    bool startsExpression(const Source &src, char before, char last) const{
+        const char c = src.peekc();
+        if(isOperator(last))
+            return false;
+        if(Source::isNum(c))
+            return !Source::isIdent(before) && before!='.';
+        if(c=='`' || c=='~')
+            return true;
+        if(c=='(')
+            return !arguments_.count(src.offset());
+        if(Source::isAlpha(c) && !Source::isIdent(before)){
+            Source keyword = src;
+            std::string word;
+            keyword.getAlphaIdentifier(word);
+            return isValueKeyword(word);
+        }
+        return false;
+    }
+
+    // Calls statement with a Source on the first word of each statement, and word with one on
+    // every other word, along with the offset of the body of the innermost function they are
+    // in. statement is also given the offset of the end of its scope.
+    template<typename Statement, typename Word>
+    bool walk(Statement statement, Word word){
+        // Where each open scope closes, and the function it is in.
+        std::vector<std::pair<uint64_t, uint64_t> > scopes;
+        std::set<uint64_t> bodies;
+
+        Source src(src_);
+        bool starts = true;
+        while(src.valid()){
+            const char c = src.peekc();
+            const uint64_t here = src.offset();
+            const uint64_t owner = scopes.empty() ? no_function : scopes.back().second;
+            const uint64_t end = scopes.empty() ? src_.length() : scopes.back().first;
+
+            if(here==end){
+                scopes.pop_back();
+                src.getc();
+                starts = false;
+            }
+            else if(c==':'){
+                std::string::const_iterator close;
+                if(!program_.scopeEnd(src.position(), close))
+                    return false;
+                scopes.push_back({offset(close), bodies.count(here) ? here : owner});
+                src.getc();
+                starts = true;
+            }
+            else if(c=='\n'){
+                src.getc();
+                starts = true;
+            }
+            else if(c=='"'){
+                if(!skipString(src))
+                    return false;
+                starts = false;
+            }
+            else if(c=='%' || isBlank(c))
+                src.skipWhitespace();
+            else if(Source::isAlpha(c)){
+                if(starts){
+                    Source keyword = src;
+                    std::string first;
+                    keyword.getAlphaIdentifier(first);
+                    if(first==function_keyword){
+                        Function func;
+                        if(ParseFunctionDeclaration(keyword, func))
+                            return false;
+                        bodies.insert(offset(func.start));
+                    }
+                    statement(Source(src), owner, end);
+                }
+                else
+                    word(Source(src), owner);
+
+                std::string ident;
+                src.getIdentifier(ident);
+                starts = false;
+            }
+            else{
+                src.getc();
+                starts = false;
+            }
+        }
+        return true;
+    }
+
+    // Whether nothing in [start, end) has been inlined over in this pass.
+    bool untouched(uint64_t start, uint64_t end) const{
+        for(const std::pair<uint64_t, uint64_t> &range : inlined_){
+            if(start<range.second && range.first<end)
+                return false;
+        }
+        return true;
+    }
+
+    // Inlines the call whose 'call' is at start, if it can be.
+    void inlineCall(uint64_t start, uint64_t limit){
+        if(!untouched(start, start + 1llu))
+            return;
+        Source src(src_);
+        src.position(at(start));
+        std::string word, keyword, name;
+        if(!(src.getAlphaIdentifier(word) && word==call_keyword && src.getAlphaIdentifier(keyword) && keyword==get_keyword && src.getIdentifier(name)))
+            return;
+        const Function *const func = staticFunction(name);
+        src.skipWhitespace();
+        if(!func || !src.match('('))
+            return;
+
+        const uint64_t count = func->args.size();
+        Arguments arguments = {*func, std::vector<Operand>(count), std::vector<std::string>(count), std::vector<uint64_t>(count, 0llu)};
+        for(uint64_t i = 0; i<count; i++){
+            src.skipWhitespace();
+            if(i && !src.match(','))
+                return;
+            src.skipWhitespace();
+            const uint64_t arg_start = src.offset();
+            Operand &arg = arguments.operands[i];
+            if(!expression(src, arg) || !arg.pure || arg.type!=func->args[i].second.our_type ||
+                !copy(arg_start, src.offset(), nullptr, arguments.texts[i]))
+                return;
+        }
+        src.skipWhitespace();
+        if(!src.match(')'))
+            return;
+        const uint64_t end = src.offset();
+
+        std::string text;
+        if(inlineBody(arguments, limit, text) && replace(start, end, text))
+            inlined_.push_back({start, end});
+    }
+
+    // Writes the expression that the function returns, with the arguments in place, as text.
+    bool inlineBody(Arguments &arguments, uint64_t limit, std::string &text){
+        const Function &func = arguments.func;
+        std::string::const_iterator close;
+        if(!program_.scopeEnd(func.start, close) || !untouched(offset(func.start), offset(close) + 1llu))
+            return false;
+
+        Source src(src_);
+        src.position(func.start);
+        src.getc();
+        src.skipWhitespaceAndNewline();
+        std::string word;
+        if(!(src.getAlphaIdentifier(word) && word==return_keyword))
+            return false;
+        src.skipWhitespace();
+        const uint64_t start = src.offset();
+
+        Operand result;
+        params_ = &func.args;
+        const bool read = expression(src, result);
+        params_ = nullptr;
+        const uint64_t end = src.offset();
+        src.skipWhitespaceAndNewline();
+        if(!read || result.type!=func.return_type || src.position()!=close)
+            return false;
+
+        std::string plain;
+        if(!copy(start, end, nullptr, plain) || plain.length()>limit)
+            return false;
+
+        text = "(";
+        if(!copy(start, end, &arguments, text))
+            return false;
+        text += ')';
+        for(uint64_t i = 0; i<arguments.uses.size(); i++){
+            if(!arguments.uses[i] || (arguments.uses[i]>1llu && !arguments.operands[i].simple))
+                return false;
+        }
+        return true;
+    }
+
+    // Appends [start, end) to text, with each run of blanks made one space. Given arguments,
+    // gets of the parameters are replaced by the arguments, in parentheses unless they are
+    // simple. Returns false if [start, end) gets the function itself.
+    bool copy(uint64_t start, uint64_t end, Arguments *arguments, std::string &text) const{
+        Source src(src_);
+        src.position(at(start));
+        while(src.offset()<end){
+            const uint64_t here = src.offset();
+            const char c = src.peekc();
+            if(c=='"'){
+                if(!skipString(src))
+                    return false;
+                text.append(src_, here, src.offset() - here);
+                continue;
+            }
+            if(c=='%' || isBlank(c)){
+                src.skipWhitespace();
+                text += ' ';
+                continue;
+            }
+            if(!Source::isAlpha(c) || (here && Source::isIdent(src_[here-1]))){
+                text += src.getc();
+                continue;
+            }
+
+            std::string word, name;
+            src.getIdentifier(word);
+            Source after = src;
+            if(word!=get_keyword || !after.getIdentifier(name)){
+                text += word;
+                continue;
+            }
+            src = after;
+            if(!arguments){
+                text += word + ' ' + name;
+                continue;
+            }
+            if(name==arguments->func.name)
+                return false;
+
+            const std::vector<std::pair<std::string, TypeSpecifier> > &params = arguments->func.args;
+            uint64_t i = 0;
+            while(i<params.size() && params[i].first!=name)
+                i++;
+            if(i==params.size()){
+                text += word + ' ' + name;
+                continue;
+            }
+
+            // Only a variable can be indexed in place of the parameter.
+            const std::string &argument = arguments->texts[i];
+            after.skipWhitespace();
+            if(after.peekc()=='[' && argument.compare(0, get_keyword.length(), get_keyword)!=0)
+                return false;
+            text += arguments->operands[i].simple ? argument : '(' + argument + ')';
+            arguments->uses[i]++;
+        }
+        return true;
+    }
+
+public:
+    Optimizer(const Program &program, std::string &src)
+      : program_(program), src_(src), changed_(false), params_(nullptr){}
+
+    inline bool changed() const { return changed_; }
+
+    // Folds every constant expression, and every constant part of one, into a literal.
+    void foldExpressions(){
+        Source src(src_);
+        char last = '\n';
+        while(src.valid()){
+            const char c = src.peekc();
+            const uint64_t here = src.offset();
+            if(c=='"'){
+                if(!skipString(src))
+                    return;
+                last = '"';
+                continue;
+            }
+            if(c=='%' || isBlank(c)){
+                src.skipWhitespace();
+                continue;
+            }
+
+            if(startsExpression(src, here ? src_[here-1] : '\n', last)){
+                Source start = src;
+                Operand result;
+                expression(start, result);
+            }
+            // The expression may have been folded from here on.
+            last = src_[here];
+            src.getc();
+        }
+    }
+
+    // Replaces each if statement with a literal condition by its body if the condition is true,
+    // which runs the same since an if statement has no scope of its own, or removes it.
+    void removeBranches(){
+        struct Branch { uint64_t start, open, close; bool taken; };
+        std::vector<Branch> branches;
+
+        const bool walked = walk([this, &branches](Source src, uint64_t, uint64_t){
+            const uint64_t start = src.offset();
+            std::string first;
+            Value condition;
+            if(!(src.getAlphaIdentifier(first) && first==if_keyword && src.skipWhitespace() && literal(src, condition)))
+                return;
+            src.skipWhitespace();
+            std::string::const_iterator close;
+            if(src.peekc()!=':' || !program_.scopeEnd(src.position(), close))
+                return;
+            branches.push_back({start, src.offset(), offset(close), ConditionalSuccess(condition)});
+        }, [](Source, uint64_t){});
+        if(!walked)
+            return;
+
+        for(const Branch &branch : branches){
+            if(branch.taken){
+                blank(branch.start, branch.open + 1llu);
+                blank(branch.close, branch.close + 1llu);
+            }
+            else
+                blank(branch.start, branch.close + 1llu);
+        }
+    }
+
+    // Finds what propagateConstants and inlineCalls work from. Returns false if the source
+    // cannot be walked.
+    bool gather(){
+        return walk([this](Source src, uint64_t owner, uint64_t end){
+            const Source start = src;
+            std::string first, name;
+            src.getAlphaIdentifier(first);
+
+            if(first==set_keyword){
+                if(src.getIdentifier(name))
+                    names_.assigned.insert(name);
+                return;
+            }
+            else if(first==function_keyword){
+                Function func;
+                if(ParseFunctionDeclaration(src, func))
+                    return;
+                names_.bind(func.name, Value::Function);
+                for(const std::pair<std::string, TypeSpecifier> &arg : func.args)
+                    names_.bind(arg.first, arg.second.our_type);
+                if(end==src_.length())
+                    functions_[func.name] = func;
+                return;
+            }
+
+            TypeSpecifier type;
+            Source declaration = first==for_keyword ? src : start;
+            if(!(ParseType(declaration, type) && declaration.getIdentifier(name)))
+                return;
+            names_.bind(name, type.our_type);
+            if(first==for_keyword)
+                return;
+
+            declaration.skipWhitespace();
+            const uint64_t literal_start = declaration.offset();
+            Value val;
+            if(!literal(declaration, val) || val.type!=type.our_type)
+                return;
+            const uint64_t literal_end = declaration.offset();
+            declaration.skipWhitespace();
+            if(declaration.valid() && declaration.peekc()!='\n' && declaration.peekc()!='.')
+                return;
+            constants_[name] = {literal_end, end, owner, src_.substr(literal_start, literal_end - literal_start)};
+        }, [this](Source src, uint64_t owner){
+            const uint64_t start = src.offset();
+            std::string first, name;
+            if(!src.getAlphaIdentifier(first))
+                return;
+            if(first==call_keyword){
+                calls_.push_back(start);
+                return;
+            }
+            if(!(first==get_keyword && src.getIdentifier(name)))
+                return;
+            const uint64_t end = src.offset();
+            src.skipWhitespace();
+            if(src.peekc()!='[')
+                gets_[name].push_back({start, end, owner});
+        });
+    }
+
+    // Replaces gets of a variable by the literal it is declared with, where that is the only
+    // variable, argument or function of that name, and nothing sets it. Only gets after the
+    // declaration, in its scope, and in the same function are replaced, since those are the
+    // only ones that cannot run before the declaration does.
+    void propagateConstants(){
+        for(const std::pair<const std::string, Constant> &constant : constants_){
+            if(names_.bindings[constant.first]!=1llu || names_.assigned.count(constant.first))
+                continue;
+            for(const Get &get : gets_[constant.first]){
+                if(get.owner==constant.second.owner && get.start>=constant.second.after && get.start<constant.second.end)
+                    replace(get.start, get.end, constant.second.text);
+            }
+        }
+    }
+
+    // Replaces calls in expressions to a function that get always finds, and whose body is only
+    // a return of an expression at most limit characters long, by that expression with the
+    // arguments in place of the parameters. The expression finds every other variable where
+    // the call would have, since the parameters are all that the function's frame holds.
+    //
+    // A call is only replaced where the expression fits in it, where the types of the arguments
+    // and of the expression are those that the call checks, and where every argument is only
+    // read, and still read. Only literals, strings and variables are read more than once.
+    void inlineCalls(uint64_t limit){
+        for(const uint64_t call : calls_)
+            inlineCall(call, limit);
+    }
+};
+
+} // namespace
+
+void Program::optimize(const CompileOptions &options){
+    // Each pass reads the source with freshly compiled scope and string tables, which are then
+    // thrown away, as the rewrites leave them out of date.
+    for(int pass = 0; pass<max_passes; pass++){
+        if(!compileScopes())
+            break;
+
+        Optimizer optimizer(*this, src_);
+        optimizer.foldExpressions();
+        optimizer.removeBranches();
+        if(optimizer.gather()){
+            optimizer.propagateConstants();
+            if(options.inline_limit)
+                optimizer.inlineCalls(options.inline_limit);
+        }
+
+        jumps_.owned().clear();
+        strings_.owned().clear();
+        string_data_.owned().clear();
+        if(!optimizer.changed())
+            break;
+    }
+
+    // Errors are left for the compile that follows to find.
+    jumps_.owned().clear();
+    strings_.owned().clear();
+    string_data_.owned().clear();
+    error_ = {Error::NoError, 0llu, std::string()};
+}
+
+} // namespace Lithium
@@ -0,0 +1,214 @@
+#include "output.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace Lithium{
+
+Output::Output(int fd, uint64_t capacity)
+  : fd_(fd), owns_fd_(false), sink_(nullptr), user_(nullptr), buffer_(std::max<uint64_t>(capacity, 64llu)), used_(0llu), total_(0llu), failed_(false){}
+
+Output::Output(const std::string &path, uint64_t capacity)
+  : fd_(open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644)), owns_fd_(true), sink_(nullptr), user_(nullptr)
+  , buffer_(std::max<uint64_t>(capacity, 64llu)), used_(0llu), total_(0llu), failed_(fd_<0){}
+
+Output::Output(Sink sink, void *user, uint64_t capacity)
+  : fd_(-1), owns_fd_(false), sink_(sink), user_(user), buffer_(std::max<uint64_t>(capacity, 64llu)), used_(0llu), total_(0llu), failed_(false){}
+
+Output::~Output(){
+    flush();
+    if(owns_fd_ && fd_>=0)
+        close(fd_);
+}
+
+bool Output::drain(const char *data, uint64_t length){
+    if(failed_)
+        return false;
+
+    if(sink_){
+        failed_ = (used_ && !sink_(buffer_.data(), used_, user_)) || (length && !sink_(data, length, user_));
+        used_ = 0llu;
+        return !failed_;
+    }
+
+    struct iovec parts[2] = {
+        { buffer_.data(), used_ },
+        { const_cast<char*>(data), length }
+    };
+    struct iovec *part = parts;
+    int count = 2;
+    while(count){
+        if(!part->iov_len){
+            part++;
+            count--;
+            continue;
+        }
+        const ssize_t written = writev(fd_, part, count);
+        if(written<0){
+            if(errno==EINTR)
+                continue;
+            failed_ = true;
+            break;
+        }
+        // A short write leaves the rest for the next call.
+        for(uint64_t done = written; done; ){
+            const uint64_t n = std::min<uint64_t>(done, part->iov_len);
+            part->iov_base = static_cast<char*>(part->iov_base) + n;
+            part->iov_len -= n;
+            done -= n;
+            if(!part->iov_len){
+                part++;
+                count--;
+            }
+        }
+    }
+    used_ = 0llu;
+    return !failed_;
+}
+
+bool Output::write(const char *data, uint64_t length){
+    total_ += length;
+    if(length > buffer_.size() - used_){
+        // Strings at least as long as the buffer skip it.
+        if(length >= buffer_.size())
+            return drain(data, length);
+        if(!drain(nullptr, 0llu))
+            return false;
+    }
+    memcpy(buffer_.data() + used_, data, length);
+    used_ += length;
+    return true;
+}
+
+bool Output::write(int64_t i){
+    // Enough for any int64_t, sign included. The digits are written from the end.
+    char digits[20];
+    char *at = digits + sizeof(digits);
+    uint64_t n = i<0 ? 0llu - uint64_t(i) : uint64_t(i);
+    do{
+        *--at = '0' + n % 10;
+        n /= 10;
+    }while(n);
+    if(i<0)
+        *--at = '-';
+    return write(at, digits + sizeof(digits) - at);
+}
+
+bool Output::write(float f){
+    // Whole numbers, which are most of what scripts print, go the integer's way, which gives
+    // what %g would for any below 1e9.
+    if(std::fabs(f) < 1e9f && f==std::floor(f))
+        return write(int64_t(f));
+
+    // The fewest digits that read back as the same float, of which 9 are always enough.
+    char digits[32];
+    int length = 0;
+    for(int precision = 6; precision<=9; precision++){
+        length = snprintf(digits, sizeof(digits), "%.*g", precision, f);
+        if(strtof(digits, nullptr)==f)
+            break;
+    }
+    return write(digits, length);
+}
+
+bool Output::write(const Value &val){
+    switch(val.type){
+        case Value::Boolean:
+            return val.value.boolean ? write("true", 4llu) : write("false", 5llu);
+        case Value::Integer:
+            return write(val.value.integer);
+        case Value::Floating:
+            return write(val.value.floating);
+        case Value::String:
+            return write(val.value.string->data(), val.value.string->length());
+        case Value::Array:{
+            if(!write("[", 1llu))
+                return false;
+            bool first = true;
+            for(const Value &element : *val.value.array){
+                if(!(first || write(", ", 2llu)) || !write(element))
+                    return false;
+                first = false;
+            }
+            return write("]", 1llu);
+        }
+        default:
+            return false;
+    }
+}
+
+bool Output::flush(){
+    return used_ ? drain(nullptr, 0llu) : !failed_;
+}
+
+// Otherwise sets bad to the type of the first part of val that cannot be written.
+static bool writable(const Value &val, Value::Type &bad){
+    switch(val.type){
+        case Value::Boolean: case Value::Integer: case Value::Floating: case Value::String:
+            return true;
+        case Value::Array:
+            for(const Value &element : *val.value.array){
+                if(!writable(element, bad))
+                    return false;
+            }
+            return true;
+        default:
+            bad = val.type;
+            return false;
+    }
+}
+
+static bool writeValue(Context &ctx, const char *name, const Value &val, bool newline, Value &result){
+    Output *const output = ctx.output;
+    if(!output)
+        return ctx.setError(Context::Error::ReferenceError, std::string(name) + " has no output to write to");
+
+    // Checked first, so that nothing is written of a value that fails.
+    Value::Type bad;
+    if(!writable(val, bad))
+        return ctx.setError(Context::Error::TypeError, std::string(name) + " cannot write a " + ValueName(bad));
+
+    const uint64_t before = output->total();
+    if(!output->write(val) || (newline && !output->write("\n", 1llu)))
+        return ctx.setError(Context::Error::ReferenceError, std::string(name) + " could not write its output");
+
+    result.type = Value::Integer;
+    result.value.integer = output->total() - before;
+    return true;
+}
+
+bool Output::printNative(Context &ctx, const Value *args, uint64_t, Value &result, void *){
+    return writeValue(ctx, "print", args[0], true, result);
+}
+
+bool Output::writeNative(Context &ctx, const Value *args, uint64_t, Value &result, void *){
+    return writeValue(ctx, "write", args[0], false, result);
+}
+
+bool Output::flushNative(Context &ctx, const Value *, uint64_t, Value &result, void *){
+    if(!ctx.output)
+        return ctx.setError(Context::Error::ReferenceError, "flush has no output to write to");
+    if(!ctx.output->flush())
+        return ctx.setError(Context::Error::ReferenceError, "flush could not write its output");
+    result.type = Value::Integer;
+    result.value.integer = 0;
+    return true;
+}
+
+bool Output::addNatives(Program &program){
+    const TypeSpecifier any = {Value::Null, Value::Null, std::string(), {}};
+    const TypeSpecifier print_signature = {Value::Function, Value::Integer, std::string(), {any}},
+        flush_signature = {Value::Function, Value::Integer, std::string(), {}};
+
+    return program.addNative("print", print_signature, printNative, nullptr, false) &&
+        program.addNative("write", print_signature, writeNative, nullptr, false) &&
+        program.addNative("flush", flush_signature, flushNative, nullptr, false);
+}
+
+} // namespace Lithium
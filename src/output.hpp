@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "context.hpp"
+
+namespace Lithium{
+
+/*
+    Buffered output for the print builtins:
+
+        print(<value>)      Writes the value and a newline. Returns the number of bytes written.
+        write(<value>)      Writes the value alone.
+        flush()             Hands everything buffered to the file or sink. Returns 0.
+
+    Strings are written as they are, integers and floats in decimal, booleans as true or false,
+    and arrays as their elements between brackets, separated by commas. Objects, dicts and
+    functions cannot be written.
+
+    The builtins write to the Context's output, and fail without one. Output is gathered in a
+    buffer, which is only written when it fills, on flush, and when the Output is destroyed. A
+    string that does not fit is written straight after the buffer with the same writev call,
+    rather than being copied into it.
+
+    An Output must only be used by one thread at a time. The workers of the parallel builtins
+    have no output.
+*/
+class Output{
+public:
+    // Returns false if the data could not be written.
+    typedef bool (*Sink)(const char *data, uint64_t length, void *user);
+
+    static const uint64_t default_capacity = 64llu * 1024llu;
+
+private:
+    int fd_;
+    bool owns_fd_;
+    Sink sink_;
+    void *user_;
+
+    std::vector<char> buffer_;
+    uint64_t used_, total_;
+    bool failed_;
+
+    // Writes out the buffer followed by data.
+    bool drain(const char *data, uint64_t length);
+
+    static bool printNative(Context &ctx, const Value *args, uint64_t num_args, Value &result, void *user);
+    static bool writeNative(Context &ctx, const Value *args, uint64_t num_args, Value &result, void *user);
+    static bool flushNative(Context &ctx, const Value *args, uint64_t num_args, Value &result, void *user);
+
+public:
+    // Writes to fd, which is not closed.
+    explicit Output(int fd = 1, uint64_t capacity = default_capacity);
+    // Creates or truncates the file at path. valid() is false if it could not be opened.
+    explicit Output(const std::string &path, uint64_t capacity = default_capacity);
+    // Hands the output to sink, a buffer at a time.
+    Output(Sink sink, void *user, uint64_t capacity = default_capacity);
+    Output(const Output &that) = delete;
+    // Flushes, and closes the file if this opened it.
+    ~Output();
+
+    // False once the file could not be opened, or a write has failed.
+    inline bool valid() const { return !failed_; }
+    // The bytes waiting in the buffer.
+    inline uint64_t buffered() const { return used_; }
+    // The bytes ever written, whether or not they are still buffered.
+    inline uint64_t total() const { return total_; }
+
+    bool write(const char *data, uint64_t length);
+    bool write(int64_t i);
+    bool write(float f);
+    // Returns false if val cannot be written, or the write failed.
+    bool write(const Value &val);
+    bool flush();
+
+    // Adds print, write and flush to program. Like Program::addNative, this must be done before
+    // any Context is created from it.
+    static bool addNatives(Program &program);
+};
+
+} // namespace Lithium
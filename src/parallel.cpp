@@ -0,0 +1,385 @@
+#include "parallel.hpp"
+#include "interpreter.hpp"
+#include "dict.hpp"
+#include <algorithm>
+#include <atomic>
+
+namespace Lithium{
+
+static thread_local const ThreadPool *current_pool = nullptr;
+
+ThreadPool::ThreadPool(unsigned size)
+  : size_(size ? size : std::max(std::thread::hardware_concurrency(), 1u)), queues_(new Queue[size_]),
+    task_(nullptr), generation_(0llu), busy_(0u), stop_(false){}
+
+ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        stop_ = true;
+    }
+    start_.notify_all();
+    for(std::thread &thread : threads_)
+        thread.join();
+}
+
+bool ThreadPool::inPool(){
+    return current_pool!=nullptr;
+}
+
+// Takes from the front of the thread's own queue, or else from the back of another's.
+bool ThreadPool::next(unsigned thread, uint64_t &task){
+    for(unsigned i = 0; i<size_; i++){
+        Queue &queue = queues_[(thread + i) % size_];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if(queue.tasks.empty())
+            continue;
+        if(i==0u){
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        else{
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::work(unsigned thread){
+    current_pool = this;
+    uint64_t seen = 0llu;
+
+    std::unique_lock<std::mutex> lock(lock_);
+    while(true){
+        start_.wait(lock, [this, seen](){ return stop_ || generation_!=seen; });
+        if(stop_)
+            return;
+        seen = generation_;
+        const Task &task = *task_;
+        lock.unlock();
+
+        uint64_t i;
+        while(next(thread, i))
+            task(i, thread);
+
+        lock.lock();
+        if(--busy_==0u)
+            done_.notify_one();
+    }
+}
+
+void ThreadPool::run(uint64_t count, const Task &task){
+    assert(!inPool());
+    std::lock_guard<std::mutex> serial(run_lock_);
+
+    if(threads_.empty()){
+        threads_.reserve(size_);
+        for(unsigned i = 0; i<size_; i++)
+            threads_.emplace_back(&ThreadPool::work, this, i);
+    }
+
+    for(unsigned i = 0; i<size_; i++){
+        std::lock_guard<std::mutex> lock(queues_[i].lock);
+        for(uint64_t t = count * i / size_; t<count * (i + 1) / size_; t++)
+            queues_[i].tasks.push_back(t);
+    }
+
+    std::unique_lock<std::mutex> lock(lock_);
+    task_ = &task;
+    busy_ = size_;
+    generation_++;
+    start_.notify_all();
+    done_.wait(lock, [this](){ return busy_==0u; });
+    task_ = nullptr;
+}
+
+// Copies val, and everything it refers to, onto ctx's heap. Returns false if that passes its
+// hard limit.
+static bool copyValue(Context &ctx, const Value &val, Value &copy){
+    copy = val;
+    switch(val.type){
+        case Value::String:
+            copy.value.string = ctx.create<String>(Value::String, val.value.string->data(), val.value.string->length());
+            return copy.value.string!=nullptr;
+        case Value::Array:
+            copy.value.array = ctx.create<std::vector<Value> >(Value::Array, *val.value.array);
+            if(!copy.value.array)
+                return false;
+            for(Value &element : *copy.value.array){
+                if(!copyValue(ctx, element, element))
+                    return false;
+            }
+            return true;
+        case Value::Object:
+            copy.value.object = ctx.create<std::map<std::string, Value> >(Value::Object, *val.value.object);
+            if(!copy.value.object)
+                return false;
+            for(std::pair<const std::string, Value> &member : *copy.value.object){
+                if(!copyValue(ctx, member.second, member.second))
+                    return false;
+            }
+            return true;
+        case Value::Dict:{
+            // val and copy may be the same Value.
+            const Dict &dict = *val.value.dict;
+            copy.value.dict = ctx.create<Dict>(Value::Dict, dict.element());
+            if(!copy.value.dict)
+                return false;
+            for(const Dict::Slot &slot : dict.slots()){
+                Value element;
+                if(slot.key_type!=Value::Null && !copyValue(ctx, slot.value, element))
+                    return false;
+                if(slot.key_type==Value::Integer)
+                    copy.value.dict->insert(slot.integer) = element;
+                else if(slot.key_type==Value::String)
+                    copy.value.dict->insert(slot.string.data(), slot.string.length(), slot.hash) = element;
+            }
+            return ctx.update(copy.value.dict, Value::Dict);
+        }
+        default:
+            return true;
+    }
+}
+
+Parallel::Parallel(const ParallelOptions &options)
+  : pool_(options.threads), min_chunk_(std::max<uint64_t>(options.min_chunk, 1llu)){}
+
+// Four chunks for each thread, so that stealing can even out chunks that take longer.
+uint64_t Parallel::chunkSize(uint64_t count) const{
+    const uint64_t chunks = pool_.size() * 4llu;
+    return std::max<uint64_t>(min_chunk_, (count + chunks - 1llu) / chunks);
+}
+
+uint64_t Parallel::chunks(uint64_t count) const{
+    return (count + chunkSize(count) - 1llu) / chunkSize(count);
+}
+
+bool Parallel::forChunks(Context &caller, uint64_t count, std::vector<Value> &results, const ChunkBody &body){
+    const uint64_t size = chunkSize(count), num_chunks = chunks(count);
+
+    // Small arrays, and builtins called from inside another builtin, stay on this thread.
+    if(num_chunks<=1llu || pool_.size()<=1u || ThreadPool::inPool()){
+        for(uint64_t c = 0; c<num_chunks; c++){
+            if(!body(caller, c * size, std::min<uint64_t>(count, (c + 1llu) * size), c))
+                return false;
+        }
+        return true;
+    }
+
+    caller.heap().freeze();
+
+    std::vector<std::unique_ptr<Context> > workers(pool_.size());
+    // The fuel handler cannot be called from the workers, so each is given an equal share of the
+    // caller's fuel, and fails when that runs out. What they burn is taken from the caller's.
+    const int64_t share = caller.fuel() / pool_.size();
+    std::vector<int64_t> fuel(pool_.size(), share);
+    // Likewise the room left under the caller's memory limits, although what the workers
+    // allocate is copied to the caller's heap afterwards, and checked against the full limits
+    // then.
+    const Heap &heap = caller.heap();
+    const uint64_t soft_limit = heap.softLimit() ? (heap.softLimit() - std::min(heap.softLimit(), heap.bytes())) / pool_.size() + 1llu : 0llu,
+        hard_limit = heap.hardLimit() ? (heap.hardLimit() - std::min(heap.hardLimit(), heap.bytes())) / pool_.size() + 1llu : 0llu;
+    // Chunks after the earliest one to fail are skipped, but every chunk before it still runs,
+    // so the error is the one that running the chunks in order would give.
+    std::atomic<uint64_t> first_failure(~0llu);
+    std::vector<Error> errors(pool_.size());
+    std::vector<uint64_t> failures(pool_.size(), ~0llu);
+    pool_.run(num_chunks, [&](uint64_t c, unsigned thread){
+        if(c > first_failure.load(std::memory_order_relaxed))
+            return;
+
+        std::unique_ptr<Context> &ctx = workers[thread];
+        if(!ctx){
+            ctx.reset(new Context(caller.program()));
+            ctx->viewGlobals(caller);
+            ctx->setFuel(fuel[thread]);
+            ctx->heap().setLimits(soft_limit, hard_limit);
+        }
+
+        if(body(*ctx, c * size, std::min<uint64_t>(count, (c + 1llu) * size), c))
+            return;
+
+        if(c < failures[thread]){
+            failures[thread] = c;
+            errors[thread] = ctx->error;
+        }
+        uint64_t first = first_failure.load(std::memory_order_relaxed);
+        while(c < first && !first_failure.compare_exchange_weak(first, c, std::memory_order_relaxed)){}
+        // A failed call can leave its frames behind, so the next chunk gets a new Context.
+        fuel[thread] = ctx->fuel();
+        ctx.reset();
+    });
+
+    int64_t burnt = 0;
+    for(unsigned thread = 0; thread<pool_.size(); thread++){
+        const std::unique_ptr<Context> &ctx = workers[thread];
+        if(ctx){
+            fuel[thread] = ctx->fuel();
+            LITHIUM_METRIC(caller.metrics.statements += ctx->metrics.statements);
+            LITHIUM_METRIC(caller.metrics.calls += ctx->metrics.calls);
+        }
+        burnt += share - fuel[thread];
+    }
+    caller.setFuel(caller.fuel() - burnt);
+
+    if(first_failure.load()!=~0llu){
+        caller.error = errors[std::min_element(failures.cbegin(), failures.cend()) - failures.cbegin()];
+        return false;
+    }
+
+    for(Value &val : results){
+        if(!copyValue(caller, val, val))
+            return false;
+    }
+    return true;
+}
+
+namespace{
+
+bool checkFunction(Context &ctx, const char *name, const Function &func, uint64_t num_args){
+    if(func.native)
+        return ctx.setError(Context::Error::TypeError, std::string(name) + " can only call script functions, not " + func.name);
+    if(func.args.size()!=num_args)
+        return ctx.setError(Context::Error::TypeError, std::string(name) + " needs a function of " + std::to_string(num_args) +
+            " arguments, but " + func.name + " takes " + std::to_string(func.args.size()));
+    return true;
+}
+
+bool checkElements(Context &ctx, const char *name, const Function &func, uint64_t arg, const std::vector<Value> &xs){
+    if(!xs.empty() && func.args[arg].second.our_type!=xs.front().type)
+        return ctx.setError(Context::Error::TypeError, std::string(name) + " was given an Array of " + ValueName(xs.front().type) +
+            ", but " + func.name + " takes " + ValueName(func.args[arg].second.our_type));
+    return true;
+}
+
+bool apply(Context &ctx, const Function &func, const Value *args, Value &result){
+    if(!InterpretFunction(ctx, func, args))
+        return false;
+    result = ctx.pop();
+    if(result.type==Value::Null)
+        return ctx.setError(Context::Error::TypeError, func.name + " returned nothing");
+    return true;
+}
+
+// The natives copy what they need out of args first, since calling anything can move the stack.
+
+bool parallelMap(Context &ctx, const Value *args, uint64_t, Value &result, void *user){
+    Parallel &parallel = *static_cast<Parallel*>(user);
+    const Function &func = *args[0].value.function;
+    std::vector<Value> *const xs = args[1].value.array;
+    if(!(checkFunction(ctx, "parallel_map", func, 1llu) && checkElements(ctx, "parallel_map", func, 0llu, *xs)))
+        return false;
+    // Nothing that f does can change the array that is being mapped.
+    Heap::share(xs);
+
+    std::vector<Value> results(xs->size());
+    const bool ok = parallel.forChunks(ctx, xs->size(), results, [&](Context &c, uint64_t begin, uint64_t end, uint64_t){
+        for(uint64_t i = begin; i<end; i++){
+            if(!apply(c, func, &(*xs)[i], results[i]))
+                return false;
+        }
+        return true;
+    });
+    if(!ok)
+        return false;
+    // f may have returned what a variable holds.
+    for(const Value &r : results){
+        if(const void *const payload = Heap::container(r))
+            Heap::share(payload);
+    }
+
+    result.type = Value::Array;
+    result.value.array = ctx.create<std::vector<Value> >(Value::Array, std::move(results));
+    return result.value.array!=nullptr;
+}
+
+bool parallelFilter(Context &ctx, const Value *args, uint64_t, Value &result, void *user){
+    Parallel &parallel = *static_cast<Parallel*>(user);
+    const Function &func = *args[0].value.function;
+    std::vector<Value> *const xs = args[1].value.array;
+    if(!(checkFunction(ctx, "parallel_filter", func, 1llu) && checkElements(ctx, "parallel_filter", func, 0llu, *xs)))
+        return false;
+    if(!(TypeIsArithmetic(func.return_type) || func.return_type==Value::Boolean))
+        return ctx.setError(Context::Error::TypeError, std::string("parallel_filter needs a function that returns Integer, Floating, or Boolean, but ") +
+            func.name + " returns " + ValueName(func.return_type));
+    Heap::share(xs);
+
+    std::vector<Value> keep(xs->size());
+    const bool ok = parallel.forChunks(ctx, xs->size(), keep, [&](Context &c, uint64_t begin, uint64_t end, uint64_t){
+        for(uint64_t i = begin; i<end; i++){
+            if(!apply(c, func, &(*xs)[i], keep[i]))
+                return false;
+        }
+        return true;
+    });
+    if(!ok)
+        return false;
+
+    std::vector<Value> *const filtered = ctx.create<std::vector<Value> >(Value::Array);
+    if(!filtered)
+        return false;
+    for(uint64_t i = 0; i<xs->size(); i++){
+        if(ConditionalSuccess(keep[i]))
+            filtered->push_back((*xs)[i]);
+    }
+    if(!ctx.update(filtered, Value::Array))
+        return false;
+
+    result.type = Value::Array;
+    result.value.array = filtered;
+    return true;
+}
+
+bool parallelReduce(Context &ctx, const Value *args, uint64_t, Value &result, void *user){
+    Parallel &parallel = *static_cast<Parallel*>(user);
+    const Function &func = *args[0].value.function;
+    std::vector<Value> *const xs = args[1].value.array;
+    Value acc = args[2];
+    if(!(checkFunction(ctx, "parallel_reduce", func, 2llu) && checkElements(ctx, "parallel_reduce", func, 1llu, *xs)))
+        return false;
+    if(func.args[0].second.our_type!=acc.type || func.args[1].second.our_type!=acc.type || func.return_type!=acc.type)
+        return ctx.setError(Context::Error::TypeError, std::string("parallel_reduce needs a function that takes and returns ") +
+            ValueName(acc.type) + ", the type of its initial value");
+    Heap::share(xs);
+
+    // Each chunk is folded starting from its own first element.
+    std::vector<Value> folds(parallel.chunks(xs->size()));
+    const bool ok = parallel.forChunks(ctx, xs->size(), folds, [&](Context &c, uint64_t begin, uint64_t end, uint64_t chunk){
+        Value pair[2] = {(*xs)[begin], (*xs)[begin]};
+        for(uint64_t i = begin + 1llu; i<end; i++){
+            pair[1] = (*xs)[i];
+            if(!apply(c, func, pair, pair[0]))
+                return false;
+        }
+        folds[chunk] = pair[0];
+        return true;
+    });
+    if(!ok)
+        return false;
+
+    for(const Value &fold : folds){
+        const Value pair[2] = {acc, fold};
+        if(!apply(ctx, func, pair, acc))
+            return false;
+    }
+
+    result = acc;
+    return true;
+}
+
+} // namespace
+
+bool Parallel::addNatives(Program &program){
+    const TypeSpecifier function = {Value::Function, Value::Null, std::string(), {}},
+        array = {Value::Array, Value::Null, std::string(), {}},
+        any = {Value::Null, Value::Null, std::string(), {}};
+    const TypeSpecifier map = {Value::Function, Value::Array, std::string(), {function, array}},
+        reduce = {Value::Function, Value::Null, std::string(), {function, array, any}};
+
+    return program.addNative("parallel_map", map, parallelMap, this) &&
+        program.addNative("parallel_filter", map, parallelFilter, this) &&
+        program.addNative("parallel_reduce", reduce, parallelReduce, this);
+}
+
+} // namespace Lithium
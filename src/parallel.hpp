@@ -0,0 +1,116 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "context.hpp"
+
+namespace Lithium{
+
+// A fixed set of threads that run a batch of numbered tasks at a time. The tasks are dealt out
+// to the threads' own queues in contiguous runs, and each thread takes from the front of its
+// queue. A thread whose queue is empty steals from the back of another's, so uneven tasks
+// still keep every thread busy. The threads are only started by the first batch.
+class ThreadPool{
+public:
+    typedef std::function<void(uint64_t task, unsigned thread)> Task;
+
+private:
+    struct Queue{
+        std::mutex lock;
+        std::deque<uint64_t> tasks;
+    };
+
+    const unsigned size_;
+    std::vector<std::thread> threads_;
+    std::unique_ptr<Queue[]> queues_;
+
+    // Guards everything below, which describes the current batch.
+    std::mutex lock_;
+    std::condition_variable start_, done_;
+    const Task *task_;
+    uint64_t generation_;
+    unsigned busy_;
+    bool stop_;
+
+    // Only one batch runs at a time.
+    std::mutex run_lock_;
+
+    void work(unsigned thread);
+    bool next(unsigned thread, uint64_t &task);
+
+public:
+    // A size of 0 means one thread per core.
+    explicit ThreadPool(unsigned size);
+    ThreadPool(const ThreadPool &that) = delete;
+    ~ThreadPool();
+
+    inline unsigned size() const { return size_; }
+
+    // Calls task(i, thread) for every i in [0, count) on the pool's threads, and returns once
+    // all of them have. Must not be called from one of the pool's own threads.
+    void run(uint64_t count, const Task &task);
+
+    // True on one of the threads of any ThreadPool.
+    static bool inPool();
+};
+
+struct ParallelOptions{
+    ParallelOptions() : threads(0u), min_chunk(256llu) {}
+
+    // 0 means one per core.
+    unsigned threads;
+    // No worker is handed fewer elements than this at once, so arrays no longer than this are
+    // handled on the calling thread.
+    uint64_t min_chunk;
+};
+
+/*
+    The parallel builtins, which split an array across a ThreadPool:
+
+        parallel_map(function f, array xs)             -> array of f(x) for each x
+        parallel_filter(function f, array xs)          -> array of each x for which f(x) is true
+        parallel_reduce(function f, array xs, init)    -> f(...f(f(init, r0), r1)..., rn)
+
+    f must be a script function. For parallel_reduce, each chunk of xs is folded with f on its
+    own, and the results of the chunks are then folded into init in order, so f has to be
+    associative.
+
+    Each worker thread calls f in a Context of its own, which sees the caller's globals but
+    assigns to its own copies of them. Before the workers start, the caller's heap is frozen
+    so that nothing they can see is written to. Results on the workers' heaps are copied to
+    the caller's. Each worker is given an equal share of the caller's fuel, without its fuel
+    handler, and what the workers burn is taken from the caller's once they are done.
+
+    One Parallel can serve any number of Programs, and must outlive the Contexts that use it.
+*/
+class Parallel{
+    ThreadPool pool_;
+    const uint64_t min_chunk_;
+
+    uint64_t chunkSize(uint64_t count) const;
+
+public:
+    typedef std::function<bool(Context &ctx, uint64_t begin, uint64_t end, uint64_t chunk)> ChunkBody;
+
+    explicit Parallel(const ParallelOptions &options = ParallelOptions());
+
+    // Adds the builtins to program. Like Program::addNative, this must be done before any
+    // Context is created from it. Returns false if the program already has one of the names.
+    bool addNatives(Program &program);
+
+    // The number of chunks that an array of count elements is split into.
+    uint64_t chunks(uint64_t count) const;
+
+    // Calls body once for each chunk of [0, count), with the range of the chunk, from the pool
+    // if there is more than one chunk and from caller otherwise. body may put results in
+    // results, which are copied to the caller's heap before the workers' Contexts are
+    // destroyed. If any call fails, its error is given to caller and this returns false.
+    bool forChunks(Context &caller, uint64_t count, std::vector<Value> &results, const ChunkBody &body);
+};
+
+} // namespace Lithium
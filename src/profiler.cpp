@@ -0,0 +1,294 @@
+#include "profiler.hpp"
+#include "program.hpp"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <sys/time.h>
+
+namespace Lithium{
+
+static std::atomic<Profiler*> sampling_profiler(nullptr);
+static struct sigaction old_action;
+
+static const uint64_t max_samples = 1llu<<18;
+
+uint64_t Profiler::now(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Profiler::Profiler(const Program &program, Mode mode, uint64_t interval_microseconds)
+  : program_(program), mode_(mode), interval_(interval_microseconds)
+  , root_({nullptr, nullptr, {}, 1llu, 0llu, 0llu, 0llu, 0llu}), current_(&root_)
+  , sampled_node_(&root_), sampled_at_(0llu)
+  , last_time_(0llu), last_line_(0llu), last_allocations_(0llu)
+  , num_samples_(0llu), dropped_samples_(0llu), running_(false){
+    functions_.push_back({nullptr, 1llu, 0llu, 0llu, 0llu, 0llu, 1llu, 0llu});
+    lines_.resize(program.line(program.source().length()) + 1);
+    if(mode_==Sampling)
+        samples_.resize(max_samples);
+}
+
+Profiler::~Profiler(){
+    stop();
+    freeNode(root_);
+}
+
+void Profiler::freeNode(Node &node){
+    for(Node *child : node.children){
+        freeNode(*child);
+        delete child;
+    }
+    node.children.clear();
+}
+
+void Profiler::start(){
+    if(running_)
+        return;
+    running_ = true;
+    last_time_ = now();
+    functions_.front().entered = last_time_;
+
+    if(mode_==Sampling){
+        Profiler *expected = nullptr;
+        if(!sampling_profiler.compare_exchange_strong(expected, this)){
+            fputs("Only one profiler can sample at a time\n", stderr);
+            return;
+        }
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = signalHandler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, &old_action);
+
+        struct itimerval timer;
+        timer.it_interval.tv_sec = interval_ / 1000000llu;
+        timer.it_interval.tv_usec = interval_ % 1000000llu;
+        timer.it_value = timer.it_interval;
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+}
+
+void Profiler::stop(){
+    if(!running_)
+        return;
+    running_ = false;
+
+    if(mode_==Sampling && sampling_profiler.load()==this){
+        struct itimerval timer;
+        memset(&timer, 0, sizeof(timer));
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        sigaction(SIGPROF, &old_action, nullptr);
+        sampling_profiler.store(nullptr);
+        collectSamples();
+    }
+
+    charge(last_allocations_);
+    functions_.front().total_nanoseconds += now() - functions_.front().entered;
+}
+
+void Profiler::signalHandler(int){
+    Profiler *const that = sampling_profiler.load(std::memory_order_relaxed);
+    if(!that)
+        return;
+
+    const uint64_t i = that->num_samples_.load(std::memory_order_relaxed);
+    if(i==that->samples_.size())
+        return;
+
+    that->samples_[i].node = that->sampled_node_.load(std::memory_order_relaxed);
+    that->samples_[i].at = that->sampled_at_.load(std::memory_order_relaxed);
+    that->num_samples_.store(i+1, std::memory_order_release);
+}
+
+// Folds the samples into the call tree and line table, with the signal blocked so that the
+// handler cannot write to the buffer as it is emptied.
+void Profiler::collectSamples(){
+    if(mode_!=Sampling)
+        return;
+
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    const uint64_t n = num_samples_.load(std::memory_order_acquire);
+    if(n && n==samples_.size())
+        dropped_samples_++;
+    for(uint64_t i = 0; i<n; i++){
+        Node *const node = samples_[i].node;
+        node->samples++;
+        functions_[node->stats].samples++;
+        lines_[program_.line(samples_[i].at)].samples++;
+    }
+    num_samples_.store(0llu, std::memory_order_release);
+
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+uint64_t Profiler::stats(const Function *function){
+    for(uint64_t i = 0; i<functions_.size(); i++)
+        if(functions_[i].function==function)
+            return i;
+    functions_.push_back({function, 0llu, 0llu, 0llu, 0llu, 0llu, 0llu, 0llu});
+    return functions_.size() - 1;
+}
+
+void Profiler::charge(uint64_t allocations){
+    const uint64_t allocated = allocations - last_allocations_;
+    last_allocations_ = allocations;
+
+    FunctionStats &function = functions_[current_->stats];
+    current_->allocations += allocated;
+    function.allocations += allocated;
+
+    if(mode_==Exact){
+        const uint64_t t = now(), elapsed = t - last_time_;
+        last_time_ = t;
+
+        current_->nanoseconds += elapsed;
+        function.self_nanoseconds += elapsed;
+        lines_[last_line_].nanoseconds += elapsed;
+        lines_[last_line_].allocations += allocated;
+    }
+}
+
+void Profiler::statement(uint64_t at, uint64_t allocations){
+    if(mode_==Exact){
+        charge(allocations);
+        last_line_ = program_.line(at);
+        lines_[last_line_].statements++;
+    }
+    else{
+        sampled_at_.store(at, std::memory_order_relaxed);
+        if(num_samples_.load(std::memory_order_relaxed) > samples_.size()/2)
+            collectSamples();
+    }
+}
+
+void Profiler::enter(const Function &function, uint64_t allocations){
+    charge(allocations);
+
+    Node *node = nullptr;
+    for(Node *child : current_->children){
+        if(child->function==&function){
+            node = child;
+            break;
+        }
+    }
+    if(!node){
+        node = new Node({&function, current_, {}, 0llu, 0llu, 0llu, 0llu, stats(&function)});
+        current_->children.push_back(node);
+    }
+
+    node->calls++;
+    current_ = node;
+    sampled_node_.store(node, std::memory_order_relaxed);
+
+    FunctionStats &s = functions_[node->stats];
+    s.calls++;
+    if(mode_==Exact && s.depth++==0)
+        s.entered = last_time_;
+}
+
+void Profiler::leave(uint64_t allocations){
+    assert(current_->parent);
+    charge(allocations);
+
+    if(mode_==Exact){
+        FunctionStats &s = functions_[current_->stats];
+        if(--s.depth==0)
+            s.total_nanoseconds += last_time_ - s.entered;
+    }
+
+    current_ = current_->parent;
+    sampled_node_.store(current_, std::memory_order_relaxed);
+}
+
+static const char *function_name(const Function *function){
+    return function ? function->name.c_str() : "<main>";
+}
+
+// Counts each sample once for every function on its call stack, however many times it recurs.
+static void total_samples(const Profiler::Node &node, std::vector<const Function*> &path,
+    std::vector<Profiler::FunctionStats> &functions){
+    path.push_back(node.function);
+    for(Profiler::FunctionStats &s : functions){
+        if(std::find(path.begin(), path.end(), s.function)!=path.end())
+            s.total_nanoseconds += node.samples;
+    }
+    for(const Profiler::Node *child : node.children)
+        total_samples(*child, path, functions);
+    path.pop_back();
+}
+
+void Profiler::report(FILE *out){
+    collectSamples();
+
+    std::vector<FunctionStats> functions = functions_;
+    if(mode_==Sampling){
+        std::vector<const Function*> path;
+        for(FunctionStats &s : functions)
+            s.total_nanoseconds = 0llu;
+        total_samples(root_, path, functions);
+    }
+
+    const bool exact = mode_==Exact;
+    const double scale = exact ? 1.0e-6 : (double)interval_ / 1000.0;
+
+    std::sort(functions.begin(), functions.end(), [exact](const FunctionStats &a, const FunctionStats &b){
+        return exact ? a.self_nanoseconds > b.self_nanoseconds : a.samples > b.samples;
+    });
+
+    fprintf(out, "%s profile of %llu functions\n", exact ? "Exact" : "Sampled", (unsigned long long)functions.size());
+    fprintf(out, "%12s %12s %12s %12s  %s\n", "calls", "self ms", "total ms", "allocs", "function");
+    for(const FunctionStats &s : functions){
+        fprintf(out, "%12llu %12.3f %12.3f %12llu  %s\n", (unsigned long long)s.calls,
+            (exact ? s.self_nanoseconds : s.samples) * scale, s.total_nanoseconds * scale,
+            (unsigned long long)s.allocations, function_name(s.function));
+    }
+
+    std::vector<uint64_t> order;
+    for(uint64_t i = 0; i<lines_.size(); i++)
+        if(lines_[i].statements || lines_[i].samples)
+            order.push_back(i);
+    std::sort(order.begin(), order.end(), [this, exact](uint64_t a, uint64_t b){
+        return exact ? lines_[a].nanoseconds > lines_[b].nanoseconds : lines_[a].samples > lines_[b].samples;
+    });
+
+    fprintf(out, "\n%12s %12s %12s %12s\n", "line", "statements", "ms", "allocs");
+    for(uint64_t i : order){
+        const LineStats &s = lines_[i];
+        fprintf(out, "%12llu %12llu %12.3f %12llu\n", (unsigned long long)(i+1), (unsigned long long)s.statements,
+            (exact ? s.nanoseconds : s.samples) * scale, (unsigned long long)s.allocations);
+    }
+
+    if(dropped_samples_)
+        fprintf(out, "\nThe sample buffer filled %llu times, some samples were dropped\n", (unsigned long long)dropped_samples_);
+}
+
+void Profiler::writeCollapsed(FILE *out, const Node &node, std::string &path) const{
+    const uint64_t length = path.length();
+    if(!path.empty())
+        path += ';';
+    path += function_name(node.function);
+
+    const uint64_t value = mode_==Exact ? node.nanoseconds / 1000llu : node.samples;
+    if(value)
+        fprintf(out, "%s %llu\n", path.c_str(), (unsigned long long)value);
+
+    for(const Node *child : node.children)
+        writeCollapsed(out, *child, path);
+
+    path.resize(length);
+}
+
+void Profiler::reportCollapsed(FILE *out){
+    collectSamples();
+    std::string path;
+    writeCollapsed(out, root_, path);
+}
+
+} // namespace Lithium
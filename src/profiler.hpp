@@ -0,0 +1,103 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "variables.hpp"
+
+namespace Lithium{
+
+class Program;
+
+// Attributes time, calls and allocations to LCL functions and source lines.
+//
+// In Exact mode, the interpreter reads the clock at every statement, call and return, and
+// charges the time since the last one to the line and call stack that were current.
+// In Sampling mode, the interpreter only publishes where it is, and a SIGPROF timer records
+// the current line and call stack every interval. Call and allocation counts are exact in
+// both modes.
+//
+// Attach a Profiler by setting Context::profiler before running. Only one Profiler can be
+// sampling at a time, since the timer signal is process-wide.
+class Profiler{
+public:
+    enum Mode { Exact, Sampling };
+
+    // A node in the call tree, which is what the collapsed stack output is made from.
+    struct Node{
+        const Function *function;
+        Node *parent;
+        std::vector<Node*> children;
+        uint64_t calls, nanoseconds, samples, allocations;
+        // Index of the function's FunctionStats.
+        uint64_t stats;
+    };
+
+    struct LineStats{
+        uint64_t statements, nanoseconds, samples, allocations;
+    };
+
+    struct FunctionStats{
+        const Function *function;
+        uint64_t calls, self_nanoseconds, total_nanoseconds, samples, allocations;
+        // Inclusive time is only counted by the outermost of recursive calls.
+        uint64_t depth, entered;
+    };
+
+private:
+    struct Sample{ Node *node; uint64_t at; };
+
+    const Program &program_;
+    const Mode mode_;
+    const uint64_t interval_;
+
+    Node root_;
+    Node *current_;
+    std::atomic<Node*> sampled_node_;
+    std::atomic<uint64_t> sampled_at_;
+
+    std::vector<LineStats> lines_;
+    std::vector<FunctionStats> functions_;
+
+    uint64_t last_time_, last_line_, last_allocations_;
+
+    // Written by the signal handler, read once sampling has stopped.
+    std::vector<Sample> samples_;
+    std::atomic<uint64_t> num_samples_;
+    uint64_t dropped_samples_;
+    bool running_;
+
+    static void signalHandler(int);
+    static uint64_t now();
+
+    uint64_t stats(const Function *function);
+    // Charges everything since the last event to the current line and call stack.
+    void charge(uint64_t allocations);
+    void collectSamples();
+    void writeCollapsed(FILE *out, const Node &node, std::string &path) const;
+    void freeNode(Node &node);
+
+public:
+    Profiler(const Program &program, Mode mode, uint64_t interval_microseconds = 1000llu);
+    Profiler(const Profiler &that) = delete;
+    ~Profiler();
+
+    inline Mode mode() const { return mode_; }
+
+    void start();
+    void stop();
+
+    // Called by the interpreter. at is the offset of the statement in the program's source,
+    // allocations is the Heap's running total.
+    void statement(uint64_t at, uint64_t allocations);
+    void enter(const Function &function, uint64_t allocations);
+    void leave(uint64_t allocations);
+
+    // A table of functions and a table of lines, each sorted by time.
+    void report(FILE *out);
+    // One line per call stack, in the "a;b;c value" format that flamegraph.pl reads.
+    void reportCollapsed(FILE *out);
+};
+
+} // namespace Lithium
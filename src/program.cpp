@@ -0,0 +1,506 @@
+#include "program.hpp"
+#include "context.hpp"
+#include "interpreter.hpp"
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+
+namespace Lithium{
+
+static const std::string function_keyword("function"),
+    set_keyword("set"),
+    call_keyword("call"),
+    get_keyword("get"),
+    for_keyword("for"),
+    if_keyword("if"),
+    loop_keyword("loop"),
+    return_keyword("return"),
+    up_keyword("up");
+
+Program::Program(const std::string &source, const CompileOptions &options)
+  : src_(source), error_({Error::NoError, 0llu, std::string()}), mapping_(nullptr), mapping_size_(0llu)
+  , cache_key_(cacheKey(source, options)){
+    if(options.optimize)
+        optimize(options);
+    if(compileScopes() && compileFunctions(0llu, src_.length(), no_function))
+        analyzeEscapes();
+    bindStrings();
+}
+
+void Program::bindStrings(){
+    string_values_.reserve(strings_.size());
+    // Hashed now, so that the contexts which use these as Dict keys never have to.
+    for(const StringConstant &constant : strings_){
+        string_values_.push_back(String::View(stringData(constant), constant.length));
+        string_values_.back().hash();
+    }
+}
+
+Program::~Program(){
+    if(mapping_)
+        munmap(mapping_, mapping_size_);
+}
+
+// Records the matching '.' of every ':', and decodes every string literal on the way.
+bool Program::compileScopes(){
+    std::vector<uint64_t> open;
+    Source src(src_);
+    char last = '\0';
+
+    while(src.valid()){
+        const char c = src.peekc();
+        const uint64_t at = offset(src.position());
+
+        if(c=='"'){
+            std::string str;
+            if(!src.getStringLiteral(str)){
+                error_ = {Error::SyntaxError, line(at), "Unterminated string literal"};
+                return false;
+            }
+            std::vector<char> &data = string_data_.owned();
+            const StringConstant constant = {at, offset(src.position()), data.size(), str.length()};
+            strings_.owned().push_back(constant);
+            if(str.length() + 2llu != constant.end - constant.start)
+                data.insert(data.end(), str.cbegin(), str.cend());
+            last = '"';
+            continue;
+        }
+        else if(c=='%'){
+            src.skipWhitespace();
+            continue;
+        }
+        else if(c==':'){
+            open.push_back(jumps_.size());
+            jumps_.owned().push_back({at, 0llu});
+        }
+        // A '.' between two digits is a decimal point.
+        else if(c=='.' && !(Source::isNum(last) && at+1<src_.length() && Source::isNum(src_[at+1]))){
+            if(open.empty()){
+                error_ = {Error::SyntaxError, line(at), "End of scope without a matching start"};
+                return false;
+            }
+            jumps_.owned()[open.back()].close = at;
+            open.pop_back();
+        }
+
+        last = src.getc();
+    }
+
+    if(!open.empty()){
+        const uint64_t at = jumps_[open.back()].open;
+        error_ = {Error::SyntaxError, line(at), "Scope is never closed"};
+        return false;
+    }
+
+    return true;
+}
+
+// Finds every function declaration in the statements between at and end, including those in
+// nested scopes, and counts the variables declared in the body of owner. Only the functions
+// outside of any scope are added to the top-level function table.
+bool Program::compileFunctions(uint64_t at, uint64_t end, uint64_t owner){
+    const bool top_level = at==0llu && owner==no_function;
+    Source src(src_);
+    src.position(src_.cbegin() + at);
+
+    while(src.skipWhitespaceAndNewline() && offset(src.position())<end){
+        // The owner of any scope opened by this statement.
+        uint64_t body_owner = owner;
+
+        Source statement = src;
+        std::string ident;
+        if(src.getAlphaIdentifier(ident) && ident==function_keyword){
+            const uint64_t declaration = offset(src.position());
+            Function func;
+            func.locals = 0llu;
+            func.native = nullptr;
+            func.user = nullptr;
+            func.contained = false;
+            if(const char *what = ParseFunctionDeclaration(src, func)){
+                error_ = {Error::SyntaxError, line(offset(src.position())), what};
+                return false;
+            }
+
+            if(top_level)
+                globals_[func.name] = functions_.size();
+            else if(owner!=no_function)
+                functions_[owner].locals++;
+
+            body_owner = functions_.size();
+            // Statements are walked in order, so declarations are found in order.
+            assert(declarations_.size()==0 || declarations_[declarations_.size()-1].at < declaration);
+            declarations_.owned().push_back({declaration, functions_.size()});
+            functions_.push_back(std::move(func));
+        }
+        else if(owner!=no_function){
+            TypeSpecifier type;
+            if(ParseType(statement, type))
+                functions_[owner].locals++;
+        }
+
+        // Scan to the end of the statement, descending into any scopes it opens.
+        while(src.valid() && offset(src.position())<end && src.peekc()!='\n'){
+            const char c = src.peekc();
+            if(c==':'){
+                std::string::const_iterator close;
+                const bool found = scopeEnd(src.position(), close);
+                assert(found);
+                if(!(found && compileFunctions(offset(src.position())+1, offset(close), body_owner)))
+                    return false;
+                src.position(close);
+                src.getc();
+            }
+            else if(c=='"'){
+                const StringConstant *constant = stringConstant(src.position());
+                assert(constant);
+                src.position(src_.cbegin() + constant->end);
+            }
+            else if(c=='%')
+                src.skipWhitespace();
+            else
+                src.getc();
+        }
+    }
+
+    return true;
+}
+
+static inline bool TypeIsHeap(Value::Type type){
+    return type==Value::String || type==Value::Object || type==Value::Array || type==Value::Dict;
+}
+
+// A function is contained if nothing it allocates can still be reached after it returns, in
+// which case the interpreter frees everything allocated during the call when it returns. That
+// makes objects and arrays that are only used inside the function as cheap as a frame.
+//
+// Allocations can only outlive a call through its return value, through a set of a variable
+// that it did not declare and that can hold a value on the heap, through a set of an element
+// of such a variable, or through a function that does any of these. Calls through variables
+// and nested functions are not looked into, and count as retaining everything. Calls to names
+// that the program does not declare wait for natives to be added, which say for themselves.
+void Program::analyzeEscapes(){
+    std::vector<std::string> nested;
+    for(const Function &func : functions_){
+        const std::map<std::string, uint64_t>::const_iterator global = globals_.find(func.name);
+        if(global==globals_.cend() || &functions_[global->second]!=&func)
+            nested.push_back(func.name);
+    }
+    std::map<std::string, bool> heap;
+    bindings(heap);
+
+    std::vector<bool> retains(functions_.size());
+    std::vector<std::vector<uint64_t> > callees(functions_.size());
+    std::vector<std::vector<std::string> > natives(functions_.size());
+    for(uint64_t i = 0; i<functions_.size(); i++)
+        retains[i] = retainsAllocations(functions_[i], nested, heap, callees[i], natives[i]);
+
+    // A function also retains whatever the functions it calls do.
+    bool changed = true;
+    while(changed){
+        changed = false;
+        for(uint64_t i = 0; i<functions_.size(); i++){
+            if(retains[i])
+                continue;
+            for(const uint64_t callee : callees[i]){
+                if(retains[callee]){
+                    retains[i] = changed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    // A function waits for every native that it, or any function that it calls, calls.
+    std::vector<std::vector<uint64_t> > callers(functions_.size());
+    std::map<std::string, std::vector<uint64_t> > direct;
+    for(uint64_t i = 0; i<functions_.size(); i++){
+        if(retains[i])
+            continue;
+        for(const uint64_t callee : callees[i])
+            callers[callee].push_back(i);
+        for(const std::string &name : natives[i])
+            direct[name].push_back(i);
+    }
+
+    unresolved_.clear();
+    unresolved_count_.assign(functions_.size(), 0llu);
+    for(const std::pair<const std::string, std::vector<uint64_t> > &native : direct){
+        std::vector<bool> reached(functions_.size());
+        std::vector<uint64_t> pending(native.second);
+        std::vector<uint64_t> &waiting = unresolved_[native.first];
+        while(!pending.empty()){
+            const uint64_t i = pending.back();
+            pending.pop_back();
+            if(reached[i])
+                continue;
+            reached[i] = true;
+            waiting.push_back(i);
+            unresolved_count_[i]++;
+            pending.insert(pending.end(), callers[i].cbegin(), callers[i].cend());
+        }
+    }
+
+    for(uint64_t i = 0; i<functions_.size(); i++)
+        functions_[i].contained = !retains[i] && !unresolved_count_[i] && !TypeIsHeap(functions_[i].return_type);
+}
+
+void Program::bindings(std::map<std::string, bool> &heap) const{
+    auto bind = [&heap](const std::string &name, Value::Type type){
+        bool &any = heap[name];
+        any = any || TypeIsHeap(type);
+    };
+
+    Source src(src_);
+    bool statement = true;
+    while(src.valid()){
+        const char c = src.peekc();
+        if(c=='\n' || c==':'){
+            src.getc();
+            statement = true;
+        }
+        else if(c=='"'){
+            const StringConstant *constant = stringConstant(src.position());
+            if(!constant)
+                return;
+            src.position(src_.cbegin() + constant->end);
+            statement = false;
+        }
+        else if(Source::isAlpha(c)){
+            Source declaration = src;
+            std::string ident, name;
+            src.getIdentifier(ident);
+            if(statement){
+                TypeSpecifier type;
+                Function func;
+                if(ident==function_keyword){
+                    if(!ParseFunctionDeclaration(src, func)){
+                        bind(func.name, Value::Function);
+                        for(const std::pair<std::string, TypeSpecifier> &arg : func.args)
+                            bind(arg.first, arg.second.our_type);
+                    }
+                }
+                else if(ident==for_keyword){
+                    if(ParseType(src, type) && src.getIdentifier(name))
+                        bind(name, type.our_type);
+                }
+                else if(ParseType(declaration, type) && declaration.getIdentifier(name))
+                    bind(name, type.our_type);
+            }
+            statement = false;
+        }
+        else if(Source::isWhitespace(c) || c=='%' || c=='\r')
+            src.skipWhitespace();
+        else{
+            src.getc();
+            statement = false;
+        }
+    }
+}
+
+// Scans the body of func for sets of variables it has not declared, and for calls. A variable
+// only counts as declared in the scope that declares it and the scopes nested in it, since a
+// declaration in a scope that is skipped leaves the name referring to an outer variable.
+bool Program::retainsAllocations(const Function &func, const std::vector<std::string> &nested, const std::map<std::string, bool> &heap,
+    std::vector<uint64_t> &callees, std::vector<std::string> &natives) const{
+    if(func.native)
+        return true;
+
+    std::string::const_iterator body_end;
+    if(!scopeEnd(func.start, body_end))
+        return true;
+
+    // Names declared in each open scope, and where each scope closes.
+    std::vector<std::string> names;
+    std::vector<std::pair<uint64_t, uint64_t> > scopes;
+    for(const std::pair<std::string, TypeSpecifier> &arg : func.args)
+        names.push_back(arg.first);
+    scopes.push_back({offset(body_end), names.size()});
+
+    auto declared = [&names](const std::string &name){
+        return std::find(names.cbegin(), names.cend(), name)!=names.cend();
+    };
+
+    Source src(src_);
+    src.position(func.start + 1);
+    // A for loop's variable belongs to the scope that follows it.
+    std::string pending;
+    bool statement = true;
+    while(src.valid() && src.position()<body_end){
+        const char c = src.peekc();
+        const uint64_t at = offset(src.position());
+
+        if(c=='.' && at==scopes.back().first){
+            names.resize(scopes.back().second);
+            scopes.pop_back();
+            src.getc();
+            statement = false;
+        }
+        else if(c==':'){
+            std::string::const_iterator close;
+            if(!scopeEnd(src.position(), close))
+                return true;
+            scopes.push_back({offset(close), names.size()});
+            if(!pending.empty())
+                names.push_back(std::move(pending));
+            pending.clear();
+            src.getc();
+            statement = true;
+        }
+        else if(c=='\n'){
+            src.getc();
+            statement = true;
+        }
+        else if(c=='"'){
+            const StringConstant *constant = stringConstant(src.position());
+            if(!constant)
+                return true;
+            src.position(src_.cbegin() + constant->end);
+            statement = false;
+        }
+        else if(Source::isAlpha(c)){
+            const Source start = src;
+            std::string ident;
+            src.getIdentifier(ident);
+
+            if(ident==call_keyword){
+                std::string word, name;
+                if(!(src.getAlphaIdentifier(word) && word==get_keyword && src.getIdentifier(name) && src.skipWhitespace() && src.peekc()=='('))
+                    return true;
+                if(declared(name) || std::find(nested.cbegin(), nested.cend(), name)!=nested.cend())
+                    return true;
+                const std::map<std::string, uint64_t>::const_iterator callee = globals_.find(name);
+                if(callee!=globals_.cend())
+                    callees.push_back(callee->second);
+                else if(!heap.count(name))
+                    natives.push_back(name);
+                else
+                    return true;
+            }
+            else if(statement){
+                if(ident==function_keyword)
+                    return true;
+                else if(ident==set_keyword){
+                    // Only sets of a variable that is not the function's own and can hold a
+                    // value on the heap, or of an element of one, can keep an allocation.
+                    std::string name;
+                    if(!src.getIdentifier(name))
+                        return true;
+                    if(!declared(name)){
+                        const std::map<std::string, bool>::const_iterator bound = heap.find(name);
+                        if(bound==heap.cend() || bound->second || !src.skipWhitespace() || src.peekc()=='[')
+                            return true;
+                    }
+                }
+                else if(ident==for_keyword){
+                    TypeSpecifier type;
+                    if(!(ParseType(src, type) && src.getIdentifier(pending)))
+                        return true;
+                }
+                else if(ident!=if_keyword && ident!=loop_keyword && ident!=return_keyword && ident!=up_keyword){
+                    Source declaration = start;
+                    TypeSpecifier type;
+                    std::string name;
+                    if(!(ParseType(declaration, type) && declaration.getIdentifier(name)))
+                        return true;
+                    names.push_back(name);
+                    src = declaration;
+                }
+            }
+            statement = false;
+        }
+        else if(Source::isWhitespace(c) || c=='%' || c=='\r')
+            src.skipWhitespace();
+        else{
+            src.getc();
+            statement = false;
+        }
+    }
+
+    return false;
+}
+
+const Table<uint64_t> &Program::newlines() const{
+    std::call_once(newlines_once_, [this](){
+        std::vector<uint64_t> &newlines = newlines_.owned();
+        const char *const begin = src_.data(), *const end = begin + src_.length();
+        for(const char *at = begin; (at = static_cast<const char*>(memchr(at, '\n', end - at))); at++)
+            newlines.push_back(at - begin);
+    });
+    return newlines_;
+}
+
+uint64_t Program::line(uint64_t offset) const{
+    const Table<uint64_t> &table = newlines();
+    return std::lower_bound(table.begin(), table.end(), offset) - table.begin();
+}
+
+bool Program::scopeEnd(std::string::const_iterator open, std::string::const_iterator &close) const{
+    const ScopeJump key = {offset(open), 0llu};
+    const ScopeJump *const i = std::lower_bound(jumps_.begin(), jumps_.end(), key,
+        [](const ScopeJump &a, const ScopeJump &b){ return a.open < b.open; });
+
+    if(i==jumps_.end() || i->open!=key.open)
+        return false;
+
+    close = src_.cbegin() + i->close;
+    return true;
+}
+
+const Program::StringConstant *Program::stringConstant(std::string::const_iterator start) const{
+    const uint64_t key = offset(start);
+    const StringConstant *const i = std::lower_bound(strings_.begin(), strings_.end(), key,
+        [](const StringConstant &a, uint64_t b){ return a.start < b; });
+
+    if(i==strings_.end() || i->start!=key)
+        return nullptr;
+    return i;
+}
+
+const Function *Program::findFunction(const std::string &name) const{
+    const std::map<std::string, uint64_t>::const_iterator i = globals_.find(name);
+    if(i==globals_.cend())
+        return nullptr;
+    return &functions_[i->second];
+}
+
+bool Program::addNative(const std::string &name, const TypeSpecifier &signature, NativeFunction native, void *user, bool retains){
+    assert(signature.our_type==Value::Function);
+    if(globals_.count(name))
+        return false;
+
+    Function func;
+    func.name = name;
+    func.return_type = signature.return_type;
+    func.start = src_.cend();
+    func.locals = 0llu;
+    for(const TypeSpecifier &arg : signature.arg_types)
+        func.args.push_back({std::string("arg") + std::to_string(func.args.size()), arg});
+    func.native = native;
+    func.user = user;
+    func.contained = false;
+
+    globals_[name] = functions_.size();
+    functions_.push_back(std::move(func));
+
+    const std::map<std::string, std::vector<uint64_t> >::iterator waiting = unresolved_.find(name);
+    if(!retains && waiting!=unresolved_.end()){
+        for(const uint64_t i : waiting->second){
+            if(--unresolved_count_[i]==0llu && !TypeIsHeap(functions_[i].return_type))
+                functions_[i].contained = true;
+        }
+        unresolved_.erase(waiting);
+    }
+    return true;
+}
+
+const Function *Program::functionDeclaredAt(std::string::const_iterator at) const{
+    const uint64_t key = offset(at);
+    const Declaration *const i = std::lower_bound(declarations_.begin(), declarations_.end(), key,
+        [](const Declaration &a, uint64_t b){ return a.at < b; });
+
+    if(i==declarations_.end() || i->at!=key)
+        return nullptr;
+    return &functions_[i->function];
+}
+
+} // namespace Lithium
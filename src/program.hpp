@@ -0,0 +1,183 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include "variables.hpp"
+
+namespace Lithium{
+
+struct Error {
+    enum Type { NoError, SyntaxError, ReferenceError, TypeError, ResourceError } type;
+    uint64_t line;
+    std::string what;
+};
+
+// A read-only array, which either owns its elements or views ones that live elsewhere, such as
+// in a mapped cache file.
+template<typename T>
+class Table{
+    std::vector<T> owned_;
+    const T *view_;
+    uint64_t view_size_;
+
+public:
+    Table() : view_(nullptr), view_size_(0llu) {}
+
+    // Only valid while the Table is not a view.
+    inline std::vector<T> &owned(){ assert(!view_); return owned_; }
+    inline void view(const T *data, uint64_t size){ owned_.clear(); view_ = data; view_size_ = size; }
+
+    inline const T *begin() const { return view_ ? view_ : owned_.data(); }
+    inline const T *end() const { return begin() + size(); }
+    inline uint64_t size() const { return view_ ? view_size_ : owned_.size(); }
+    inline const T &operator[](uint64_t i) const { return begin()[i]; }
+};
+
+// How a Program is compiled.
+struct CompileOptions{
+    CompileOptions() : optimize(true), inline_limit(64llu) {}
+
+    // Rewrites the source before it is compiled, as described at Program::optimize. Turning
+    // this off runs the source exactly as written, which helps when debugging.
+    bool optimize;
+    // Calls to functions whose body is a single return of an expression of at most this many
+    // characters are replaced by the expression where it fits. 0 keeps every call, so that
+    // profiles and errors name the functions they happen in.
+    uint64_t inline_limit;
+};
+
+// An LCL program, compiled once and then shared by any number of Contexts.
+// Everything that can be known from the source alone lives here: the source text, the
+// matching end of every scope, every function declaration and the decoded string constants.
+// A Program is never modified after construction, so Contexts on different threads can
+// execute the same Program at once without locking.
+class Program{
+public:
+    struct ScopeJump { uint64_t open, close; };
+    // A literal with escapes is decoded into the program's string data at offset value. One
+    // without, which is any literal whose length is two quotes shorter than its source, is
+    // used straight from the source.
+    struct StringConstant { uint64_t start, end, value, length; };
+    struct Declaration { uint64_t at, function; };
+
+private:
+    std::string src_;
+
+    // Sorted by open offset.
+    Table<ScopeJump> jumps_;
+    // Sorted by start offset.
+    Table<StringConstant> strings_;
+    Table<char> string_data_;
+    // The value of each string constant, in the same order.
+    std::vector<String> string_values_;
+    // The offset of every newline. This is only needed for errors and profiling, so it is built
+    // the first time a line is asked for.
+    mutable Table<uint64_t> newlines_;
+    mutable std::once_flag newlines_once_;
+
+    std::vector<Function> functions_;
+    // Top-level functions, which are visible everywhere in the program.
+    std::map<std::string, uint64_t> globals_;
+    // Every function declaration, sorted by the offset just after its 'function' keyword.
+    Table<Declaration> declarations_;
+
+    Error error_;
+
+    // The cache file that the tables are viewing, if any.
+    void *mapping_;
+    uint64_t mapping_size_;
+    // A hash of the source as written and of the options that change what it compiles to,
+    // which the cache is keyed by, so that using it skips optimizing too.
+    uint64_t cache_key_;
+    static uint64_t cacheKey(const std::string &source, const CompileOptions &options);
+
+    // Simplifies the source in place. Constant expressions are folded, if statements with a
+    // constant condition are replaced by their body or removed, and gets of variables that are
+    // only ever declared once, with a literal, and never set are replaced by the literal. Calls
+    // to small functions are inlined as described at CompileOptions::inline_limit. Every
+    // rewrite keeps the length of what it replaces and every newline in it, so that offsets and
+    // line numbers are those of the source as written.
+    void optimize(const CompileOptions &options);
+    bool compileScopes();
+    static const uint64_t no_function = ~0llu;
+    bool compileFunctions(uint64_t at, uint64_t end, uint64_t owner);
+
+    // Sets Function::contained for every script function.
+    void analyzeEscapes();
+    bool retainsAllocations(const Function &func, const std::vector<std::string> &nested, const std::map<std::string, bool> &heap,
+        std::vector<uint64_t> &callees, std::vector<std::string> &natives) const;
+    // Finds every name that the program declares, and whether any of them can hold a value on
+    // the heap.
+    void bindings(std::map<std::string, bool> &heap) const;
+
+    // Script functions that would be contained if not for calls to names that nothing in the
+    // program declares, which can only be natives. Each such name lists the functions that
+    // reach it, and each function counts the names it still waits for. Adding a native that
+    // retains nothing counts it off. See addNative.
+    std::map<std::string, std::vector<uint64_t> > unresolved_;
+    std::vector<uint64_t> unresolved_count_;
+
+    bool loadCache(const std::string &path);
+    void bindStrings();
+    const Table<uint64_t> &newlines() const;
+
+public:
+    Program(const std::string &source, const CompileOptions &options = CompileOptions());
+    // Uses the compiled form of source in the cache file at cache_path if it is up to date, or
+    // else compiles source and tries to write the cache file for next time.
+    Program(const std::string &source, const std::string &cache_path, const CompileOptions &options = CompileOptions());
+    Program() = delete;
+    Program(const Program &that) = delete;
+    ~Program();
+
+    inline bool valid() const { return error_.type==Error::NoError; }
+    inline const Error &error() const { return error_; }
+
+    // The source after optimization, which is what runs.
+    inline const std::string &source() const { return src_; }
+    inline uint64_t offset(std::string::const_iterator i) const { return i - src_.cbegin(); }
+    // The zero-based line that offset is on. Safe to call from any thread.
+    uint64_t line(uint64_t offset) const;
+
+    // Finds the '.' that closes the scope opened by the ':' at open.
+    bool scopeEnd(std::string::const_iterator open, std::string::const_iterator &close) const;
+
+    // Returns the decoded string literal which starts at the '"' at start, or nullptr.
+    const StringConstant *stringConstant(std::string::const_iterator start) const;
+    inline const char *stringData(const StringConstant &constant) const {
+        return constant.length + 2llu == constant.end - constant.start ?
+            src_.data() + constant.start + 1 : string_data_.begin() + constant.value;
+    }
+    // The value of a string literal, which lives as long as the Program.
+    inline const String *stringValue(const StringConstant &constant) const { return &string_values_[&constant - strings_.begin()]; }
+
+    // Returns the top-level function with this name, or nullptr.
+    const Function *findFunction(const std::string &name) const;
+    // Returns the function declared immediately after the 'function' keyword at i, or nullptr.
+    const Function *functionDeclaredAt(std::string::const_iterator i) const;
+
+    // Adds a top-level function implemented by the host. signature is a function type. An
+    // argument type or return type of Null means that any type is accepted or returned.
+    // This must be called before any Context is created from this Program, as it is the only
+    // part of a Program that is not safe to share. A script function of the same name wins.
+    // A native that retains nothing keeps neither its arguments nor anything it allocates
+    // after it returns, other than its result, and calls no script functions. Script functions
+    // that call it can then still be contained.
+    bool addNative(const std::string &name, const TypeSpecifier &signature, NativeFunction native, void *user = nullptr,
+        bool retains = true);
+
+    inline uint64_t numFunctions() const { return functions_.size(); }
+    inline const Function *function(uint64_t i) const { return &functions_[i]; }
+    inline uint64_t functionIndex(const Function *function) const { return function - functions_.data(); }
+    // A hash of the optimized source, which is what snapshots are keyed by.
+    uint64_t hash() const;
+
+    // True if the tables were read from a cache file rather than compiled.
+    inline bool cached() const { return mapping_!=nullptr; }
+    // Writes the optimized source and compiled form of the program, keyed by a hash of its
+    // source as written and its CompileOptions. Natives are not part of the cache.
+    bool writeCache(const std::string &path) const;
+};
+
+} // namespace Lithium
@@ -0,0 +1,346 @@
+#include "program.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The cache file is the Program's tables, laid out so that they can be used in place once the
+// file is mapped. It starts with a CacheHeader, which is followed by these sections, each
+// starting on an eight byte boundary:
+//   scope jumps, string constants, newline offsets, declarations, string data, functions,
+//   optimized source
+// Functions hold strings, so they are the only section that has to be decoded when loading.
+// The function section ends with the natives that functions wait for (see addNative).
+// The optimized source is as long as the source as written, and replaces it when loading, so
+// that a program loaded from the cache is never optimized.
+//
+// A cache is only used if its version and the layout check match this build, and its key and
+// length match the source and options it is loaded for.
+
+namespace Lithium{
+
+namespace{
+
+const char cache_magic[8] = {'L', 'C', 'L', 'C', 'A', 'C', 'H', 'E'};
+const uint32_t cache_version = 5u;
+
+struct CacheHeader{
+    char magic[8];
+    uint32_t version;
+    // Catches caches written on a machine with different endianness or struct layout.
+    uint32_t check;
+    uint64_t key, source_length;
+    uint64_t jumps, strings, newlines, declarations, string_bytes, functions, function_bytes;
+};
+
+uint32_t layoutCheck(){
+    return 0x01000000u | (sizeof(Program::ScopeJump)<<16) | (sizeof(Program::StringConstant)<<8) | sizeof(Program::Declaration);
+}
+
+inline uint64_t padded(uint64_t size){
+    return (size + 7llu) & ~7llu;
+}
+
+void writeNumber(std::string &out, uint64_t n){
+    out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+}
+
+void writeString(std::string &out, const std::string &str){
+    writeNumber(out, str.length());
+    out += str;
+}
+
+void writeType(std::string &out, const TypeSpecifier &type){
+    writeNumber(out, type.our_type);
+    writeNumber(out, type.return_type);
+    writeString(out, type.prototype);
+    writeNumber(out, type.arg_types.size());
+    for(const TypeSpecifier &arg : type.arg_types)
+        writeType(out, arg);
+}
+
+// Reads the function section, failing on anything that runs past its end.
+class Reader{
+    const char *at_, *end_;
+public:
+    Reader(const char *at, const char *end) : at_(at), end_(end) {}
+
+    bool number(uint64_t &n){
+        if((uint64_t)(end_ - at_) < sizeof(n))
+            return false;
+        memcpy(&n, at_, sizeof(n));
+        at_ += sizeof(n);
+        return true;
+    }
+
+    bool type(Value::Type &type){
+        uint64_t n;
+        if(!number(n) || n>Value::Dict)
+            return false;
+        type = static_cast<Value::Type>(n);
+        return true;
+    }
+
+    bool string(std::string &str){
+        uint64_t length;
+        if(!number(length) || (uint64_t)(end_ - at_) < length)
+            return false;
+        str.assign(at_, length);
+        at_ += length;
+        return true;
+    }
+
+    bool typeSpecifier(TypeSpecifier &type){
+        uint64_t args;
+        if(!(this->type(type.our_type) && this->type(type.return_type) && string(type.prototype) && number(args)))
+            return false;
+        if(args > (uint64_t)(end_ - at_))
+            return false;
+        type.arg_types.resize(args);
+        for(TypeSpecifier &arg : type.arg_types)
+            if(!typeSpecifier(arg))
+                return false;
+        return true;
+    }
+};
+
+bool writeAll(FILE *file, const void *data, uint64_t size){
+    static const char zeroes[8] = {0};
+    return fwrite(data, 1, size, file)==size && fwrite(zeroes, 1, padded(size) - size, file)==padded(size) - size;
+}
+
+} // namespace
+
+uint64_t Program::hash() const{
+    return HashString(src_.data(), src_.length());
+}
+
+uint64_t Program::cacheKey(const std::string &source, const CompileOptions &options){
+    const uint64_t parts[3] = {HashString(source.data(), source.length()), options.optimize, options.optimize ? options.inline_limit : 0llu};
+    return HashString(reinterpret_cast<const char*>(parts), sizeof(parts));
+}
+
+Program::Program(const std::string &source, const std::string &cache_path, const CompileOptions &options)
+  : src_(source), error_({Error::NoError, 0llu, std::string()}), mapping_(nullptr), mapping_size_(0llu)
+  , cache_key_(cacheKey(source, options)){
+    if(!loadCache(cache_path)){
+        if(options.optimize)
+            optimize(options);
+        if(compileScopes() && compileFunctions(0llu, src_.length(), no_function)){
+            analyzeEscapes();
+            writeCache(cache_path);
+        }
+    }
+    bindStrings();
+}
+
+bool Program::writeCache(const std::string &path) const{
+    if(!valid())
+        return false;
+
+    std::string functions;
+    uint64_t num_functions = 0llu;
+    for(const Function &func : functions_){
+        // Natives are only ever added after the script's own functions.
+        if(func.native)
+            break;
+
+        const std::map<std::string, uint64_t>::const_iterator global = globals_.find(func.name);
+        writeString(functions, func.name);
+        writeNumber(functions, func.return_type);
+        writeNumber(functions, offset(func.start));
+        writeNumber(functions, func.locals);
+        writeNumber(functions, global!=globals_.cend() && global->second==num_functions);
+        writeNumber(functions, func.contained);
+        writeNumber(functions, unresolved_count_[num_functions]);
+        writeNumber(functions, func.args.size());
+        for(const std::pair<std::string, TypeSpecifier> &arg : func.args){
+            writeString(functions, arg.first);
+            writeType(functions, arg.second);
+        }
+        num_functions++;
+    }
+    writeNumber(functions, unresolved_.size());
+    for(const std::pair<const std::string, std::vector<uint64_t> > &native : unresolved_){
+        writeString(functions, native.first);
+        writeNumber(functions, native.second.size());
+        for(const uint64_t i : native.second)
+            writeNumber(functions, i);
+    }
+
+    CacheHeader header;
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    header.check = layoutCheck();
+    header.key = cache_key_;
+    header.source_length = src_.length();
+    header.jumps = jumps_.size();
+    header.strings = strings_.size();
+    // The cache always has the newline index, so that loading it never has to scan the source.
+    header.newlines = newlines().size();
+    header.declarations = declarations_.size();
+    header.string_bytes = string_data_.size();
+    header.functions = num_functions;
+    header.function_bytes = functions.size();
+
+    // Written under another name and renamed into place, so that other processes only ever
+    // see a complete cache.
+    const std::string temporary = path + "." + std::to_string(getpid());
+    FILE *const file = fopen(temporary.c_str(), "wb");
+    if(!file)
+        return false;
+
+    bool ok = writeAll(file, &header, sizeof(header)) &&
+        writeAll(file, jumps_.begin(), jumps_.size() * sizeof(ScopeJump)) &&
+        writeAll(file, strings_.begin(), strings_.size() * sizeof(StringConstant)) &&
+        writeAll(file, newlines_.begin(), newlines_.size() * sizeof(uint64_t)) &&
+        writeAll(file, declarations_.begin(), declarations_.size() * sizeof(Declaration)) &&
+        writeAll(file, string_data_.begin(), string_data_.size()) &&
+        writeAll(file, functions.data(), functions.size()) &&
+        writeAll(file, src_.data(), src_.length());
+    ok = fclose(file)==0 && ok;
+
+    if(!(ok && rename(temporary.c_str(), path.c_str())==0)){
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Program::loadCache(const std::string &path){
+    const int fd = open(path.c_str(), O_RDONLY);
+    if(fd<0)
+        return false;
+
+    struct stat info;
+    if(fstat(fd, &info)!=0 || (uint64_t)info.st_size < sizeof(CacheHeader)){
+        close(fd);
+        return false;
+    }
+
+    const uint64_t size = info.st_size;
+    void *const mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping==MAP_FAILED)
+        return false;
+
+    const char *const base = static_cast<const char*>(mapping);
+    CacheHeader header;
+    memcpy(&header, base, sizeof(header));
+
+    const uint64_t length = src_.length();
+    bool ok = !memcmp(header.magic, cache_magic, sizeof(cache_magic)) && header.version==cache_version &&
+        header.check==layoutCheck() && header.source_length==length;
+
+    // No section can be larger than the file, which also keeps the sums below from overflowing.
+    ok = ok && header.jumps < size && header.strings < size && header.newlines < size &&
+        header.declarations < size && header.string_bytes < size && header.function_bytes < size;
+
+    uint64_t at = padded(sizeof(CacheHeader));
+    const uint64_t jumps = at;          at += padded(header.jumps * sizeof(ScopeJump));
+    const uint64_t strings = at;        at += padded(header.strings * sizeof(StringConstant));
+    const uint64_t newlines = at;       at += padded(header.newlines * sizeof(uint64_t));
+    const uint64_t declarations = at;   at += padded(header.declarations * sizeof(Declaration));
+    const uint64_t string_data = at;    at += padded(header.string_bytes);
+    const uint64_t functions = at;      at += padded(header.function_bytes);
+    const uint64_t source = at;         at += padded(length);
+    ok = ok && at==size && header.key==cache_key_;
+    const char *const optimized = base + source;
+
+    // Functions hold strings, so they are decoded rather than viewed. They point into the source,
+    // which is only replaced once everything has been checked.
+    std::vector<Function> loaded;
+    std::vector<uint64_t> starts, counts;
+    std::map<std::string, std::vector<uint64_t> > unresolved;
+    std::map<std::string, uint64_t> globals;
+    if(ok && header.functions < size){
+        Reader r(base + functions, base + functions + header.function_bytes);
+        for(uint64_t i = 0; ok && i<header.functions; i++){
+            Function func;
+            uint64_t start, top_level, contained, count, args;
+            ok = r.string(func.name) && r.type(func.return_type) && r.number(start) && r.number(func.locals) &&
+                r.number(top_level) && r.number(contained) && r.number(count) && r.number(args) && start<length && optimized[start]==':' && args<size;
+            if(!ok)
+                break;
+
+            starts.push_back(start);
+            counts.push_back(count);
+            func.native = nullptr;
+            func.user = nullptr;
+            func.contained = contained!=0llu;
+            func.args.resize(args);
+            for(std::pair<std::string, TypeSpecifier> &arg : func.args)
+                ok = ok && r.string(arg.first) && r.typeSpecifier(arg.second);
+
+            if(top_level)
+                globals[func.name] = i;
+            loaded.push_back(std::move(func));
+        }
+
+        uint64_t natives;
+        ok = ok && r.number(natives) && natives<size;
+        for(uint64_t n = 0; ok && n<natives; n++){
+            std::string name;
+            uint64_t waiting = 0llu;
+            ok = r.string(name) && r.number(waiting) && waiting<=loaded.size();
+            std::vector<uint64_t> &functions = unresolved[name];
+            for(uint64_t w = 0; ok && w<waiting; w++){
+                uint64_t i;
+                ok = r.number(i) && i<loaded.size();
+                functions.push_back(i);
+            }
+        }
+
+        // addNative counts each function off once for each native it waits for.
+        std::vector<uint64_t> waits(loaded.size());
+        for(const std::pair<const std::string, std::vector<uint64_t> > &native : unresolved)
+            for(const uint64_t i : native.second)
+                waits[i]++;
+        ok = ok && waits==counts;
+    }
+    else
+        ok = false;
+
+    // Everything the interpreter will follow from the tables has to land inside the source.
+    const ScopeJump *const jump_table = reinterpret_cast<const ScopeJump*>(base + jumps);
+    for(uint64_t i = 0; ok && i<header.jumps; i++)
+        ok = jump_table[i].open < jump_table[i].close && jump_table[i].close < length;
+    const StringConstant *const string_table = reinterpret_cast<const StringConstant*>(base + strings);
+    for(uint64_t i = 0; ok && i<header.strings; i++){
+        const StringConstant &c = string_table[i];
+        ok = c.start < c.end && c.end <= length && (c.length + 2llu == c.end - c.start ||
+            (c.value <= header.string_bytes && c.length <= header.string_bytes - c.value));
+    }
+    const Declaration *const declaration_table = reinterpret_cast<const Declaration*>(base + declarations);
+    for(uint64_t i = 0; ok && i<header.declarations; i++)
+        ok = declaration_table[i].at <= length && declaration_table[i].function < loaded.size();
+
+    if(!ok){
+        munmap(mapping, size);
+        return false;
+    }
+
+    src_.assign(optimized, length);
+    for(uint64_t i = 0; i<loaded.size(); i++)
+        loaded[i].start = src_.cbegin() + starts[i];
+
+    jumps_.view(jump_table, header.jumps);
+    strings_.view(string_table, header.strings);
+    std::call_once(newlines_once_, [this, base, newlines, &header](){
+        newlines_.view(reinterpret_cast<const uint64_t*>(base + newlines), header.newlines);
+    });
+    declarations_.view(declaration_table, header.declarations);
+    string_data_.view(base + string_data, header.string_bytes);
+    functions_ = std::move(loaded);
+    globals_ = std::move(globals);
+    unresolved_ = std::move(unresolved);
+    unresolved_count_ = std::move(counts);
+
+    mapping_ = mapping;
+    mapping_size_ = size;
+    return true;
+}
+
+} // namespace Lithium
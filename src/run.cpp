@@ -1,16 +1,99 @@
 #include "run.hpp"
 #include "context.hpp"
 #include "interpreter.hpp"
+#include "input.hpp"
+#include "output.hpp"
+#include <cstdlib>
+#include <cstring>
 
 namespace Lithium{
 
-bool runString(const std::string &source){
-    Context ctx(source);
+static const char *error_name(Error::Type type){
+    switch(type){
+        case Error::NoError: return "NoError";
+        case Error::SyntaxError: return "SyntaxError";
+        case Error::ReferenceError: return "ReferenceError";
+        case Error::TypeError: return "TypeError";
+        case Error::ResourceError: return "ResourceError";
+    }
+    return "UnknownError";
+}
 
-    return InterpretProgram(ctx);
+static void print_error(const Error &error){
+    fprintf(stderr, "%s on line %llu: %s\n", error_name(error.type), (unsigned long long)error.line + 1, error.what.c_str());
 }
 
-bool runFile(FILE *file){
+bool runProgram(const Program &program, const RunOptions &options){
+    if(!program.valid()){
+        print_error(program.error());
+        return false;
+    }
+
+    Output output;
+    Context ctx(program);
+    ctx.output = &output;
+    if(options.fuel)
+        ctx.setFuel(options.fuel);
+    ctx.heap().setLimits(0llu, options.memory_limit);
+
+    Profiler profiler(program, options.profile_mode);
+    if(options.profile){
+        ctx.profiler = &profiler;
+        profiler.start();
+    }
+
+    const bool ok = InterpretProgram(ctx);
+    // What the script printed comes before its error.
+    output.flush();
+    if(!ok)
+        print_error(ctx.error);
+
+    if(options.profile){
+        profiler.stop();
+        profiler.report(stderr);
+        if(!options.collapsed_path.empty()){
+            if(FILE *out = fopen(options.collapsed_path.c_str(), "w")){
+                profiler.reportCollapsed(out);
+                fclose(out);
+            }
+            else
+                fprintf(stderr, "Could not open %s\n", options.collapsed_path.c_str());
+        }
+    }
+
+    if(!options.metrics_path.empty()){
+        if(options.metrics_path=="-")
+            ctx.metrics.writeJSON(stderr);
+        else if(FILE *out = fopen(options.metrics_path.c_str(), "w")){
+            ctx.metrics.writeJSON(out);
+            fclose(out);
+        }
+        else
+            fprintf(stderr, "Could not open %s\n", options.metrics_path.c_str());
+    }
+
+    return ok;
+}
+
+bool runString(const std::string &source, const RunOptions &options){
+    Parallel parallel(options.parallel);
+    if(!options.cache_path.empty() && options.cache_path!="+"){
+        Program program(source, options.cache_path, options.compile);
+        parallel.addNatives(program);
+        Output::addNatives(program);
+        Input::addNatives(program);
+        return runProgram(program, options);
+    }
+
+    Program program(source, options.compile);
+    parallel.addNatives(program);
+    Output::addNatives(program);
+    Input::addNatives(program);
+
+    return runProgram(program, options);
+}
+
+bool runFile(FILE *file, const RunOptions &options){
     if(!file)
         return false;
     else{
@@ -19,25 +102,87 @@ bool runFile(FILE *file){
         while(int len = fread(buffer, 1, sizeof(buffer), file)){
             src.append(buffer, len);
         }
-        return runString(src);
+        return runString(src, options);
     }
 }
 
-bool runFile(const std::string &path){
-    return runFile(fopen(path.c_str(), "r"));
+bool runFile(const std::string &path, const RunOptions &options){
+    FILE *const file = fopen(path.c_str(), "r");
+    if(options.cache_path=="+"){
+        RunOptions cached = options;
+        cached.cache_path = path + ".cache";
+        const bool ok = runFile(file, cached);
+        if(file)
+            fclose(file);
+        return ok;
+    }
+    const bool ok = runFile(file, options);
+    if(file)
+        fclose(file);
+    return ok;
 }
 
 } // namespace Lithium
 
+static void usage(){
+    fputs("Usage: lithium [--profile[=exact|sample]] [--profile-collapsed=<file>] [--metrics[=<file>]] [--cache[=<file>]]\n"
+        "               [--threads=<n>] [--min-chunk=<n>] [--fuel=<n>] [--memory-limit=<bytes>] [--no-optimize]\n"
+        "               [--no-inline] [<script>]\n", stderr);
+}
+
 int main(int argc, char *argv[]){
-    if(argc>1)
-        return Lithium::runFile(argv[1]);
+    Lithium::RunOptions options;
+    const char *path = nullptr;
+
+    for(int i = 1; i<argc; i++){
+        if(!strcmp(argv[i], "--profile") || !strcmp(argv[i], "--profile=exact")){
+            options.profile = true;
+            options.profile_mode = Lithium::Profiler::Exact;
+        }
+        else if(!strcmp(argv[i], "--profile=sample")){
+            options.profile = true;
+            options.profile_mode = Lithium::Profiler::Sampling;
+        }
+        else if(!strncmp(argv[i], "--profile-collapsed=", 20))
+            options.collapsed_path = argv[i] + 20;
+        else if(!strcmp(argv[i], "--metrics"))
+            options.metrics_path = "-";
+        else if(!strncmp(argv[i], "--metrics=", 10))
+            options.metrics_path = argv[i] + 10;
+        else if(!strcmp(argv[i], "--cache"))
+            options.cache_path = "+";
+        else if(!strncmp(argv[i], "--cache=", 8))
+            options.cache_path = argv[i] + 8;
+        else if(!strncmp(argv[i], "--threads=", 10))
+            options.parallel.threads = strtoul(argv[i] + 10, nullptr, 10);
+        else if(!strncmp(argv[i], "--min-chunk=", 12))
+            options.parallel.min_chunk = strtoull(argv[i] + 12, nullptr, 10);
+        else if(!strncmp(argv[i], "--fuel=", 7))
+            options.fuel = strtoll(argv[i] + 7, nullptr, 10);
+        else if(!strncmp(argv[i], "--memory-limit=", 15))
+            options.memory_limit = strtoull(argv[i] + 15, nullptr, 10);
+        else if(!strcmp(argv[i], "--no-optimize"))
+            options.compile.optimize = false;
+        else if(!strcmp(argv[i], "--no-inline"))
+            options.compile.inline_limit = 0llu;
+        else if(argv[i][0]=='-' && argv[i][1]=='-'){
+            usage();
+            return EXIT_FAILURE;
+        }
+        else
+            path = argv[i];
+    }
+
+    bool ok;
+    if(path)
+        ok = Lithium::runFile(path, options);
     else{
-        char c;
+        int c;
         std::string src;
         while((c=getchar())!=EOF){
             src+=c;
         }
-        return Lithium::runString(src);
+        ok = Lithium::runString(src, options);
     }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -1,12 +1,40 @@
 #pragma once
 #include <cstdio>
 #include <string>
+#include "program.hpp"
+#include "profiler.hpp"
+#include "parallel.hpp"
 
 namespace Lithium{
 
-bool runString(const std::string &string);
-bool runFile(FILE *file);
-bool runFile(const std::string &path);
+struct RunOptions{
+    RunOptions() : profile(false), profile_mode(Profiler::Exact), fuel(0ll), memory_limit(0llu) {}
+
+    // The flat profile report is written to stderr.
+    bool profile;
+    Profiler::Mode profile_mode;
+    // If not empty, collapsed stacks are written to this file.
+    std::string collapsed_path;
+    // If not empty, the Context's metrics are written to this file as JSON. "-" is stderr.
+    std::string metrics_path;
+    // If not empty, the compiled program is kept in this file between runs. "+" is the
+    // script's path with .cache appended, which only runFile with a path can use.
+    std::string cache_path;
+    // If not 0, the script fails once it has made this many calls and loop iterations.
+    int64_t fuel;
+    // If not 0, the script fails once its heap would hold more than this many bytes.
+    uint64_t memory_limit;
+    // How runString and runFile compile the program.
+    CompileOptions compile;
+    // For the parallel builtins, which runString and runFile add to the program.
+    ParallelOptions parallel;
+};
+
+// A Program can be run any number of times, from any number of threads at once.
+bool runProgram(const Program &program, const RunOptions &options = RunOptions());
+bool runString(const std::string &string, const RunOptions &options = RunOptions());
+bool runFile(FILE *file, const RunOptions &options = RunOptions());
+bool runFile(const std::string &path, const RunOptions &options = RunOptions());
 
 } // namespace Lithium
 
@@ -0,0 +1,391 @@
+#include "embed.hpp"
+#include "interpreter.hpp"
+#include "dict.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A snapshot is the graph of values reachable from a Context's globals, written so that it
+// does not depend on where anything was allocated. Every heap block gets an index, and values
+// refer to blocks, and to the program's functions, by index. Restoring maps the image, makes
+// one heap allocation per block, and then fixes each reference up from an index to a pointer.
+//
+// The image is a SnapshotHeader followed by four tables: blocks, values, members and bytes.
+// Block 0 is the globals. A String block is a range of bytes, an Array block a range of values,
+// and an Object block a range of members, each of which is a key in bytes and a value. A Dict
+// block is a range of values: one whose type is the Dict's element type, then a key and a value
+// for each entry. String keys are written as String blocks of their own.
+
+namespace Lithium{
+
+namespace{
+
+const char snapshot_magic[8] = {'L', 'C', 'L', 'S', 'N', 'A', 'P', '\0'};
+const uint32_t snapshot_version = 2u;
+
+struct SnapshotHeader{
+    char magic[8];
+    uint32_t version, check;
+    uint64_t program_hash, functions;
+    uint64_t blocks, values, members, bytes;
+};
+
+struct ImageBlock { uint64_t type, first, count; };
+// data is the value itself for scalars, or a block or function index.
+struct ImageValue { uint64_t type, data; };
+struct ImageMember { uint64_t key, key_length; ImageValue value; };
+
+uint32_t layoutCheck(){
+    return 0x01000000u | (sizeof(ImageBlock)<<16) | (sizeof(ImageValue)<<8) | sizeof(ImageMember);
+}
+
+class Writer{
+    const Program &program_;
+    std::map<const void*, uint64_t> indices_;
+
+public:
+    std::vector<ImageBlock> blocks;
+    std::vector<ImageValue> values;
+    std::vector<ImageMember> members;
+    std::string bytes;
+
+    Writer(const Program &program) : program_(program) {}
+
+    ImageValue value(const Value &val){
+        ImageValue image = {(uint64_t)val.type, 0llu};
+        switch(val.type){
+            case Value::Null:
+                break;
+            case Value::Boolean: case Value::Integer: case Value::Floating:
+                static_assert(sizeof(val.value)==sizeof(image.data), "Values must fit in an image value");
+                memcpy(&image.data, &val.value, sizeof(image.data));
+                break;
+            case Value::Function:
+                image.data = program_.functionIndex(val.value.function);
+                break;
+            case Value::String:
+                image.data = block(val.value.string, val.type);
+                break;
+            case Value::Object:
+                image.data = block(val.value.object, val.type);
+                break;
+            case Value::Array:
+                image.data = block(val.value.array, val.type);
+                break;
+            case Value::Dict:
+                image.data = block(val.value.dict, val.type);
+                break;
+        }
+        return image;
+    }
+
+    // Blocks are numbered the first time they are reached, so that values which share a block
+    // still share it once restored.
+    uint64_t block(const void *at, Value::Type type){
+        const std::map<const void*, uint64_t>::const_iterator i = indices_.find(at);
+        if(i!=indices_.cend())
+            return i->second;
+
+        const uint64_t index = blocks.size();
+        indices_[at] = index;
+        blocks.push_back({(uint64_t)type, 0llu, 0llu});
+
+        ImageBlock block = {(uint64_t)type, 0llu, 0llu};
+        if(type==Value::String){
+            const String &str = *static_cast<const String*>(at);
+            block.first = bytes.size();
+            block.count = str.length();
+            bytes.append(str.data(), str.length());
+        }
+        else if(type==Value::Array){
+            const std::vector<Value> &array = *static_cast<const std::vector<Value>*>(at);
+            // Reserve the block's range first, since the elements can add blocks of their own.
+            block.first = values.size();
+            block.count = array.size();
+            values.resize(values.size() + array.size());
+            for(uint64_t e = 0; e<array.size(); e++){
+                const ImageValue element = value(array[e]);
+                values[block.first + e] = element;
+            }
+        }
+        else if(type==Value::Dict)
+            dict(*static_cast<const Dict*>(at), block);
+        else
+            object(*static_cast<const std::map<std::string, Value>*>(at), block);
+        blocks[index] = block;
+        return index;
+    }
+
+    void dict(const Dict &dict, ImageBlock &block){
+        block.first = values.size();
+        block.count = 1llu + dict.size() * 2llu;
+        values.resize(values.size() + block.count);
+        values[block.first] = {(uint64_t)dict.element(), 0llu};
+        uint64_t v = block.first + 1llu;
+        for(const Dict::Slot &slot : dict.slots()){
+            if(slot.key_type==Value::Null)
+                continue;
+            ImageValue key = {(uint64_t)slot.key_type, (uint64_t)slot.integer};
+            if(slot.key_type==Value::String){
+                key.data = blocks.size();
+                blocks.push_back({(uint64_t)Value::String, bytes.size(), slot.string.length()});
+                bytes += slot.string;
+            }
+            const ImageValue val = value(slot.value);
+            values[v++] = key;
+            values[v++] = val;
+        }
+    }
+
+    void object(const std::map<std::string, Value> &object, ImageBlock &block){
+        block.first = members.size();
+        block.count = object.size();
+        members.resize(members.size() + object.size());
+        uint64_t m = block.first;
+        for(const std::pair<const std::string, Value> &member : object){
+            const ImageValue val = value(member.second);
+            ImageMember &image = members[m++];
+            image.key = bytes.size();
+            image.key_length = member.first.length();
+            image.value = val;
+            bytes += member.first;
+        }
+    }
+};
+
+bool writeAll(FILE *file, const void *data, uint64_t size){
+    return fwrite(data, 1, size, file)==size;
+}
+
+} // namespace
+
+bool WriteSnapshot(Context &ctx, const std::string &path){
+    // Later global scopes shadow earlier ones, as they do in lookups.
+    std::map<std::string, Value> globals;
+    for(const Scope &scope : ctx.scopes){
+        if(scope.scope.type!=Value::Object)
+            break;
+        for(const std::pair<const std::string, Value> &global : *scope.scope.value.object)
+            globals[global.first] = global.second;
+    }
+
+    Writer writer(ctx.program());
+    writer.block(&globals, Value::Object);
+
+    SnapshotHeader header;
+    memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+    header.version = snapshot_version;
+    header.check = layoutCheck();
+    header.program_hash = ctx.program().hash();
+    header.functions = ctx.program().numFunctions();
+    header.blocks = writer.blocks.size();
+    header.values = writer.values.size();
+    header.members = writer.members.size();
+    header.bytes = writer.bytes.size();
+
+    const std::string temporary = path + "." + std::to_string(getpid());
+    FILE *const file = fopen(temporary.c_str(), "wb");
+    if(!file)
+        return false;
+
+    bool ok = writeAll(file, &header, sizeof(header)) &&
+        writeAll(file, writer.blocks.data(), writer.blocks.size() * sizeof(ImageBlock)) &&
+        writeAll(file, writer.values.data(), writer.values.size() * sizeof(ImageValue)) &&
+        writeAll(file, writer.members.data(), writer.members.size() * sizeof(ImageMember)) &&
+        writeAll(file, writer.bytes.data(), writer.bytes.size());
+    ok = fclose(file)==0 && ok;
+
+    if(!(ok && rename(temporary.c_str(), path.c_str())==0)){
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Checks a value read from an image before anything is allocated for it.
+static bool valid_value(const ImageValue &val, const SnapshotHeader &header, const ImageBlock *blocks){
+    switch(val.type){
+        case Value::Null: case Value::Boolean: case Value::Integer: case Value::Floating:
+            return true;
+        case Value::Function:
+            return val.data < header.functions;
+        case Value::String: case Value::Object: case Value::Array: case Value::Dict:
+            return val.data && val.data < header.blocks && blocks[val.data].type==val.type;
+    }
+    return false;
+}
+
+bool RestoreSnapshot(Context &ctx, const std::string &path){
+    const int fd = open(path.c_str(), O_RDONLY);
+    if(fd<0)
+        return false;
+
+    struct stat info;
+    if(fstat(fd, &info)!=0 || (uint64_t)info.st_size < sizeof(SnapshotHeader)){
+        close(fd);
+        return false;
+    }
+
+    const uint64_t size = info.st_size;
+    void *const mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping==MAP_FAILED)
+        return false;
+
+    const char *const base = static_cast<const char*>(mapping);
+    SnapshotHeader header;
+    memcpy(&header, base, sizeof(header));
+
+    bool ok = !memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) && header.version==snapshot_version &&
+        header.check==layoutCheck() && header.functions==ctx.program().numFunctions() &&
+        header.blocks < size && header.values < size && header.members < size && header.bytes < size &&
+        sizeof(SnapshotHeader) + header.blocks * sizeof(ImageBlock) + header.values * sizeof(ImageValue) +
+            header.members * sizeof(ImageMember) + header.bytes == size &&
+        header.blocks && header.program_hash==ctx.program().hash();
+
+    const ImageBlock *const blocks = reinterpret_cast<const ImageBlock*>(base + sizeof(SnapshotHeader));
+    const ImageValue *const values = reinterpret_cast<const ImageValue*>(blocks + header.blocks);
+    const ImageMember *const members = reinterpret_cast<const ImageMember*>(values + header.values);
+    const char *const bytes = reinterpret_cast<const char*>(members + header.members);
+
+    for(uint64_t b = 0; ok && b<header.blocks; b++){
+        const ImageBlock &block = blocks[b];
+        if(block.type==Value::String)
+            ok = block.first <= header.bytes && block.count <= header.bytes - block.first;
+        else if(block.type==Value::Array){
+            ok = block.first <= header.values && block.count <= header.values - block.first;
+            for(uint64_t e = 0; ok && e<block.count; e++)
+                ok = valid_value(values[block.first + e], header, blocks);
+        }
+        else if(block.type==Value::Object){
+            ok = block.first <= header.members && block.count <= header.members - block.first;
+            for(uint64_t m = 0; ok && m<block.count; m++){
+                const ImageMember &member = members[block.first + m];
+                ok = member.key <= header.bytes && member.key_length <= header.bytes - member.key &&
+                    valid_value(member.value, header, blocks);
+            }
+        }
+        else if(block.type==Value::Dict){
+            ok = block.first < header.values && block.count <= header.values - block.first && block.count % 2llu==1llu &&
+                values[block.first].type<=Value::Dict;
+            for(uint64_t e = 1; ok && e<block.count; e += 2){
+                const ImageValue &key = values[block.first + e], &val = values[block.first + e + 1];
+                ok = (key.type==Value::Integer || key.type==Value::String) && valid_value(key, header, blocks) &&
+                    val.type==values[block.first].type && valid_value(val, header, blocks);
+            }
+        }
+        else
+            ok = false;
+    }
+    ok = ok && blocks[0].type==Value::Object;
+
+    if(!ok){
+        munmap(mapping, size);
+        return false;
+    }
+
+    // Allocate every block, then fix up the references between them. Nothing can refer to the
+    // globals block, so it is not kept on the heap. If the blocks do not fit under the heap's
+    // hard limit, they are all freed again.
+    const Heap::Mark mark = ctx.heap().mark();
+    std::map<std::string, Value> globals;
+    std::vector<void*> pointers(header.blocks);
+    pointers[0] = &globals;
+    for(uint64_t b = 1; b<header.blocks; b++){
+        const ImageBlock &block = blocks[b];
+        if(block.type==Value::String)
+            pointers[b] = ctx.heap().create<String>(Value::String, bytes + block.first, block.count);
+        else if(block.type==Value::Array)
+            pointers[b] = ctx.heap().create<std::vector<Value> >(Value::Array, block.count);
+        else if(block.type==Value::Dict)
+            pointers[b] = ctx.heap().create<Dict>(Value::Dict, static_cast<Value::Type>(values[block.first].type));
+        else
+            pointers[b] = ctx.heap().create<std::map<std::string, Value> >(Value::Object);
+
+        if(!pointers[b]){
+            ctx.heap().rollback(mark);
+            munmap(mapping, size);
+            return ctx.outOfMemory(static_cast<Value::Type>(block.type));
+        }
+        // A block can be both a global and an element, which only the flag keeps track of.
+        Heap::share(pointers[b]);
+    }
+
+    const Program &program = ctx.program();
+    auto fixup = [&](const ImageValue &image){
+        Value val;
+        val.type = static_cast<Value::Type>(image.type);
+        switch(val.type){
+            case Value::Null: case Value::Boolean: case Value::Integer: case Value::Floating:
+                memcpy(&val.value, &image.data, sizeof(val.value));
+                break;
+            case Value::Function:
+                val.value.function = program.function(image.data);
+                break;
+            case Value::String:
+                val.value.string = static_cast<const String*>(pointers[image.data]);
+                break;
+            case Value::Object:
+                val.value.object = static_cast<std::map<std::string, Value>*>(pointers[image.data]);
+                break;
+            case Value::Array:
+                val.value.array = static_cast<std::vector<Value>*>(pointers[image.data]);
+                break;
+            case Value::Dict:
+                val.value.dict = static_cast<Dict*>(pointers[image.data]);
+                break;
+        }
+        return val;
+    };
+
+    for(uint64_t b = 0; b<header.blocks; b++){
+        const ImageBlock &block = blocks[b];
+        if(block.type==Value::Array){
+            std::vector<Value> &array = *static_cast<std::vector<Value>*>(pointers[b]);
+            for(uint64_t e = 0; e<block.count; e++)
+                array[e] = fixup(values[block.first + e]);
+        }
+        else if(block.type==Value::Object){
+            std::map<std::string, Value> &object = *static_cast<std::map<std::string, Value>*>(pointers[b]);
+            for(uint64_t m = 0; m<block.count; m++){
+                const ImageMember &member = members[block.first + m];
+                object[std::string(bytes + member.key, member.key_length)] = fixup(member.value);
+            }
+        }
+        else if(block.type==Value::Dict){
+            Dict &dict = *static_cast<Dict*>(pointers[b]);
+            for(uint64_t e = 1; e<block.count; e += 2)
+                dict.insert(fixup(values[block.first + e])) = fixup(values[block.first + e + 1]);
+        }
+
+        if(b && (block.type==Value::Object || block.type==Value::Dict) && !ctx.heap().update(pointers[b])){
+            ctx.heap().rollback(mark);
+            munmap(mapping, size);
+            return ctx.outOfMemory(static_cast<Value::Type>(block.type));
+        }
+    }
+
+    for(const std::pair<const std::string, Value> &global : globals)
+        ctx.addGlobal(global.first, global.second);
+
+    munmap(mapping, size);
+    return true;
+}
+
+bool InitializeContext(Context &ctx, const std::string &snapshot_path){
+    if(RestoreSnapshot(ctx, snapshot_path)){
+        ctx.setWatermark();
+        return true;
+    }
+
+    if(!InterpretProgram(ctx))
+        return false;
+    WriteSnapshot(ctx, snapshot_path);
+    ctx.setWatermark();
+    return true;
+}
+
+} // namespace Lithium
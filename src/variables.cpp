@@ -1,11 +1,15 @@
 #include "variables.hpp"
 #include "context.hpp"
+#include "heap.hpp"
 #include <algorithm>
+#include <mutex>
 
 namespace Lithium{
 
 bool VerifyPrototypes(Context &ctx, const TypeSpecifier &type){
     if(type.our_type==Value::Object){
+        if(type.prototype.empty())
+            return true;
         Value val = ctx.findObject(type.prototype);
         return val.type==Value::Object;
     }
@@ -32,11 +36,70 @@ std::string ValueName(Value::Type t){
         CASE_Z(Object);
         CASE_Z(Array);
         CASE_Z(Function);
+        CASE_Z(Dict);
         default: return "UnknownType";
     }
 #undef CASE_Z
 }
 
+uint64_t HashString(const char *data, uint64_t length){
+    uint64_t hash = 0xcbf29ce484222325llu;
+    for(uint64_t i = 0; i<length; i++){
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3llu;
+    }
+    return hash;
+}
+
+String::String(const String &left, const String &right, Heap *heap)
+  : view_(nullptr), length_(left.length() + right.length()), left_(nullptr), right_(nullptr), heap_(heap), hash_(0llu){
+    if(length_ < min_rope_length){
+        owned_.reserve(length_);
+        owned_.append(left.data(), left.length());
+        owned_.append(right.data(), right.length());
+    }
+    else{
+        left_ = &left;
+        right_ = &right;
+    }
+}
+
+// Walks the rope with an explicit stack, since strings built by appending in a loop make ropes
+// as deep as the number of appends. The halves are only read, so a rope that is also the half
+// of another is still a rope afterwards.
+void String::flatten() const{
+    static std::mutex lock;
+    std::lock_guard<std::mutex> guard(lock);
+    const String *const left = left_.load(std::memory_order_relaxed);
+    // Another thread got here first.
+    if(!left)
+        return;
+
+    std::string flat;
+    flat.reserve(length_);
+
+    std::vector<const String*> pending;
+    pending.push_back(right_);
+    pending.push_back(left);
+    while(!pending.empty()){
+        const String *const str = pending.back();
+        pending.pop_back();
+        if(const String *const half = str->left_.load(std::memory_order_relaxed)){
+            pending.push_back(str->right_);
+            pending.push_back(half);
+        }
+        else
+            flat.append(str->data(), str->length_);
+    }
+
+    owned_ = std::move(flat);
+    view_ = nullptr;
+    right_ = nullptr;
+    left_.store(nullptr, std::memory_order_release);
+    if(heap_)
+        heap_->charge(this);
+}
+
 // Returns Null for uncastable comparison
 Value::Type MutualCast(Value::Type a, Value::Type b){
     if(a==b)
@@ -1,12 +1,84 @@
 #pragma once
+#include <string>
 #include <vector>
 #include <map>
 #include <memory>
 #include <cassert>
+#include <atomic>
 
 namespace Lithium{
 
 struct Function;
+class Heap;
+
+// FNV-1a, used for the program's hash and for Dict keys.
+uint64_t HashString(const char *data, uint64_t length);
+
+// An immutable string. A literal without escapes views the program's source, and every other
+// String owns a copy of its characters.
+//
+// Concatenating long Strings makes a rope node that only refers to its two halves, so building
+// a string by repeated appends is linear. A rope is flattened into one copy the first time its
+// characters are needed, and only then is its heap charged for them. The halves must live at
+// least as long as the rope.
+//
+// Contexts on other threads can read the same String. The first to need the characters of a
+// rope flattens it under a lock, and only then clears left_, so the others either see the rope
+// and wait for the lock, or see it flat.
+class String{
+    mutable const char *view_;
+    uint64_t length_;
+    mutable std::string owned_;
+    mutable std::atomic<const String*> left_;
+    mutable const String *right_;
+    // The heap that a rope is on, if any.
+    Heap *heap_;
+    // Zero until hash() is first called.
+    mutable std::atomic<uint64_t> hash_;
+
+    String() : view_(nullptr), length_(0llu), left_(nullptr), right_(nullptr), heap_(nullptr), hash_(0llu) {}
+
+    void flatten() const;
+
+public:
+    // Concatenations shorter than this are copied rather than made into ropes.
+    static const uint64_t min_rope_length = 64llu;
+
+    String(const std::string &str) : view_(nullptr), length_(str.length()), owned_(str), left_(nullptr), right_(nullptr), heap_(nullptr), hash_(0llu) {}
+    String(const char *data, uint64_t length) : view_(nullptr), length_(length), owned_(data, length), left_(nullptr), right_(nullptr), heap_(nullptr), hash_(0llu) {}
+    // The concatenation of left and right. heap is the one the String is being created on, and
+    // may be nullptr if it is not on one.
+    String(const String &left, const String &right, Heap *heap);
+    String(const String &that)
+      : view_(that.view_), length_(that.length_), owned_(that.owned_), left_(that.left_.load()), right_(that.right_), heap_(that.heap_), hash_(that.hash_.load()) {}
+
+    // The characters must outlive the String.
+    static inline String View(const char *data, uint64_t length){
+        String str;
+        str.view_ = data;
+        str.length_ = length;
+        return str;
+    }
+
+    inline const char *data() const {
+        if(isRope())
+            flatten();
+        return view_ ? view_ : owned_.data();
+    }
+    inline bool isRope() const { return left_.load(std::memory_order_acquire)!=nullptr; }
+    inline uint64_t length() const { return length_; }
+    inline char operator[](uint64_t i) const { return data()[i]; }
+    inline std::string str() const { return std::string(data(), length_); }
+    // Cached, so that a String used as a key again and again is only hashed once.
+    inline uint64_t hash() const {
+        uint64_t hash = hash_.load(std::memory_order_relaxed);
+        if(!hash){
+            hash = HashString(data(), length_);
+            hash_.store(hash, std::memory_order_relaxed);
+        }
+        return hash;
+    }
+};
 
 struct Value{
     enum Type {
@@ -17,17 +89,19 @@ struct Value{
         String,
         Object,
         Array,
-        Function
+        Function,
+        Dict
     }type;
 
     union{
         int64_t integer;
         float floating;
         bool boolean;
-        std::string *string;
+        const class String *string;
         std::map<std::string, Value> *object;
         std::vector<Value> *array;
-        struct Function *function;
+        const struct Function *function;
+        class Dict *dict;
     } value;
 
 };
@@ -35,7 +109,7 @@ struct Value{
 // A more complete set of type information than what is available from Value::Type.
 struct TypeSpecifier{
     // our_type is the type of a variable.
-    // return_type is the return type for functions and the array type for arrays.
+    // return_type is the return type for functions and the element type for arrays and dicts.
     Value::Type our_type, return_type;
     // Prototype name for objects.
     std::string prototype;
@@ -115,9 +189,27 @@ struct bitrotateright{ inline T operator()(T a, T b) const { return a>>b | (a<<(
 
 } // namespace arith
 
+class Context;
+
+// Native functions read their arguments straight off of the operand stack. They must not use
+// the stack themselves, since that would invalidate args. On failure, they should set the
+// Context's error and return false.
+typedef bool (*NativeFunction)(Context &ctx, const Value *args, uint64_t num_args, Value &result, void *user);
+
 struct Function{
+    std::string name;
+    Value::Type return_type;
+    // Sits on the ':' that opens the body.
     std::string::const_iterator start;
     std::vector<std::pair<std::string, TypeSpecifier> > args;
+    // The number of variables declared in the body, not counting arguments.
+    uint64_t locals;
+    // Set for functions implemented by the host, in which case start is meaningless.
+    NativeFunction native;
+    void *user;
+    // Nothing allocated during a call can be reached once it returns, so everything allocated
+    // since the call started is freed when it does. See Program::analyzeEscapes.
+    bool contained;
 };
 
 std::string ValueName(Value::Type t);
@@ -0,0 +1,80 @@
+#include "../src/program.hpp"
+#include "../src/context.hpp"
+#include "../src/embed.hpp"
+#include <cstdio>
+#include <cstdlib>
+
+// Grows an array one element at a time, passing it to a function after every write. Passing
+// an array only holds it for the length of the call, so each write after it still goes in
+// place, and the heap stays within a bound proportional to the array. Copying it on every
+// write would pass that bound long before the loop ends. Also checks that writes which do need
+// a copy still make one.
+
+namespace{
+
+const int64_t elements = 20000;
+// Enough for the array, whose capacity can be twice its size, and the two copies that the end
+// of the script makes of it.
+const uint64_t heap_bound = 128llu * elements;
+
+const char *const script =
+    "function int first(array int xs):\n"
+    "    return get xs[int 0]\n"
+    ".\n"
+    "function int poke(array int xs):\n"
+    "    set xs[int 0] 99\n"
+    "    return get xs[int 0]\n"
+    ".\n"
+    "array int a [int 0]\n"
+    "int sum 0\n"
+    "for int i 20000 :\n"
+    "    set a[int get i] get i\n"
+    "    set sum get sum + call get first(get a)\n"
+    ".\n"
+    "array int b get a\n"
+    "set b[int 0] 7\n"
+    "int poked call get poke(get a)\n"
+    "int kept get a[int 0]\n"
+    "int copied get b[int 0]\n"
+    "int last get a[int 19999]\n";
+
+bool fail(const char *what){
+    fprintf(stderr, "copy_on_write: %s\n", what);
+    return false;
+}
+
+bool expect(Lithium::Context &ctx, const char *name, int64_t value){
+    Lithium::Value val;
+    if(!Lithium::GetGlobal(ctx, name, val) || val.type!=Lithium::Value::Integer)
+        return fail("a global is missing");
+    if(val.value.integer!=value){
+        fprintf(stderr, "copy_on_write: %s is %lld, expected %lld\n", name, (long long)val.value.integer, (long long)value);
+        return false;
+    }
+    return true;
+}
+
+bool run(){
+    // Unoptimized, so that first is called rather than inlined.
+    Lithium::CompileOptions options;
+    options.optimize = false;
+    Lithium::Program program(script, options);
+    if(!program.valid())
+        return fail(program.error().what.c_str());
+
+    Lithium::Context ctx(program);
+    ctx.heap().setLimits(0llu, heap_bound);
+    if(!Lithium::InitializeContext(ctx))
+        return fail(ctx.error.what.c_str());
+
+    fprintf(stderr, "copy_on_write: %lld writes, peak heap %llu bytes, %llu allocations\n",
+        (long long)elements, (unsigned long long)ctx.heap().peakBytes(), (unsigned long long)ctx.heap().total());
+    return expect(ctx, "sum", 0) && expect(ctx, "poked", 99) && expect(ctx, "kept", 0) &&
+        expect(ctx, "copied", 7) && expect(ctx, "last", elements - 1);
+}
+
+} // namespace
+
+int main(){
+    return run() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
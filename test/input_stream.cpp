@@ -0,0 +1,99 @@
+#include "../src/program.hpp"
+#include "../src/context.hpp"
+#include "../src/embed.hpp"
+#include "../src/input.hpp"
+#include "../src/output.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+// Streams a file of many megabytes through input_lines with callbacks that count into a global
+// and write every record, with a '.' in place of its newline. Checks that the heap never holds
+// more than a few records at once. Neither callback keeps a record, so both are contained
+// however they accumulate.
+
+namespace{
+
+const uint64_t lines = 200000llu;
+// Far less than the file, but enough for a record and what a callback makes of it.
+const uint64_t heap_bound = 64llu * 1024llu;
+
+const char *const script =
+    "int count 0\n"
+    "int written 0\n"
+    "function int counter(string line):\n"
+    "    set count get count + 1\n"
+    "    return 0\n"
+    ".\n"
+    "function int echo(string line):\n"
+    "    set written get written + call get write(get line + \".\")\n"
+    "    return 0\n"
+    ".\n"
+    "function int stream(string path):\n"
+    "    return call get input_lines(get path, get counter) + call get input_lines(get path, get echo)\n"
+    ".\n";
+
+bool discard(const char *, uint64_t length, void *user){
+    *static_cast<uint64_t*>(user) += length;
+    return true;
+}
+
+bool fail(const char *what){
+    fprintf(stderr, "input_stream: %s\n", what);
+    return false;
+}
+
+bool run(const std::string &path, uint64_t size){
+    Lithium::Program program(script);
+    if(!program.valid())
+        return fail(program.error().what.c_str());
+    if(!Lithium::Output::addNatives(program) || !Lithium::Input::addNatives(program))
+        return fail("could not add the natives");
+
+    Lithium::Context ctx(program);
+    uint64_t sunk = 0llu;
+    Lithium::Output output(discard, &sunk);
+    ctx.output = &output;
+    if(!Lithium::InitializeContext(ctx))
+        return fail(ctx.error.what.c_str());
+
+    Lithium::Value result;
+    if(!Lithium::CallFunction(ctx, "stream", result, Lithium::ToValue(ctx, path)))
+        return fail(ctx.error.what.c_str());
+    output.flush();
+
+    Lithium::Value count, written;
+    if(!(Lithium::GetGlobal(ctx, "count", count) && Lithium::GetGlobal(ctx, "written", written)))
+        return fail("the globals are missing");
+    if(result.value.integer!=int64_t(2llu * lines) || count.value.integer!=int64_t(lines))
+        return fail("not every line was read");
+    if(uint64_t(written.value.integer)!=size || sunk!=size)
+        return fail("not every line was written");
+
+    fprintf(stderr, "input_stream: %llu bytes streamed twice, peak heap %llu bytes\n",
+        (unsigned long long)size, (unsigned long long)ctx.heap().peakBytes());
+    if(ctx.heap().peakBytes() > heap_bound)
+        return fail("the heap grew with the file");
+    return true;
+}
+
+} // namespace
+
+int main(){
+    char path[] = "/tmp/lithium_input_stream_XXXXXX";
+    const int fd = mkstemp(path);
+    FILE *const file = fd>=0 ? fdopen(fd, "w") : nullptr;
+    if(!file){
+        fail("could not create the input file");
+        return EXIT_FAILURE;
+    }
+    uint64_t size = 0llu;
+    for(uint64_t i = 0; i<lines; i++)
+        size += fprintf(file, "record %llu, which is padded out to a few dozen bytes\n", (unsigned long long)i);
+    fclose(file);
+
+    const bool ok = run(path, size);
+    unlink(path);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,62 @@
+#include "../src/program.hpp"
+#include "../src/context.hpp"
+#include "../src/embed.hpp"
+#include <cstdio>
+#include <cstdlib>
+
+// Builds a string by appending to it many times, under a heap limit proportional to its final
+// length. Each append makes a rope node, which is charged for itself but not for the characters
+// under it, so the heap grows linearly. Charging every node for its whole length would pass the
+// limit a small fraction of the way through. Then reads the string, which flattens it, and
+// checks that the heap was charged for the characters then.
+
+namespace{
+
+const uint64_t appends = 10000llu, length = appends * 10llu;
+// A rope node and its block header come to about 13 bytes for each of the 10 characters that
+// an append adds.
+const uint64_t heap_bound = 32llu * length;
+
+const char *const script =
+    "string s \"\"\n"
+    "for int i 10000 :\n"
+    "    set s get s + \"0123456789\"\n"
+    ".\n"
+    "function int at(int i):\n"
+    "    return get s[int get i]\n"
+    ".\n";
+
+bool fail(const char *what){
+    fprintf(stderr, "rope_append: %s\n", what);
+    return false;
+}
+
+bool run(){
+    Lithium::Program program(script);
+    if(!program.valid())
+        return fail(program.error().what.c_str());
+
+    Lithium::Context ctx(program);
+    ctx.heap().setLimits(0llu, heap_bound);
+    if(!Lithium::InitializeContext(ctx))
+        return fail(ctx.error.what.c_str());
+    const uint64_t built = ctx.heap().bytes();
+
+    Lithium::Value result;
+    if(!Lithium::CallFunction(ctx, "at", result, Lithium::ToValue(int64_t(length - 1llu))))
+        return fail(ctx.error.what.c_str());
+    if(result.type!=Lithium::Value::Integer || result.value.integer!='9')
+        return fail("the last character is wrong");
+
+    fprintf(stderr, "rope_append: %llu appends, %llu bytes as a rope, %llu once flattened\n",
+        (unsigned long long)appends, (unsigned long long)built, (unsigned long long)ctx.heap().bytes());
+    if(ctx.heap().bytes() < built + length)
+        return fail("flattening did not charge the heap for the characters");
+    return true;
+}
+
+} // namespace
+
+int main(){
+    return run() ? EXIT_SUCCESS : EXIT_FAILURE;
+}